@@ -18,6 +18,7 @@
 # https://github.com/agl/jbig2enc
 
 import glob
+import shutil
 import struct
 import sys
 from pathlib import Path
@@ -31,14 +32,6 @@ from pathlib import Path
 dpi = 72  # Default DPI value
 
 
-class Ref:
-    def __init__(self, x: int):
-        self.x = x
-
-    def __str__(self) -> str:
-        return f"{self.x} 0 R"
-
-
 class Dict:
     def __init__(self, values: dict = None):
         if values is None:
@@ -50,77 +43,76 @@ class Dict:
         return f"<< {' '.join(entries)} >>\n"
 
 
-class Obj:
-    next_id = 1
-
-    def __init__(self, d: dict = None, stream: str = None):
-        if d is None:
-            d = {}
-        if stream is not None:
-            d["Length"] = str(len(stream))
-        self.d = Dict(d)
-        self.stream = stream
-        self.id = Obj.next_id
-        Obj.next_id += 1
-
-    def __str__(self) -> str:
-        result = [str(self.d)]
-        if self.stream is not None:
-            result.append(f"stream\n{self.stream}\nendstream\n")
-        result.append("endobj\n")
-        return "".join(result)
-
-
-class Doc:
-    def __init__(self):
-        self.objs = []
-        self.pages = []
-
-    def add_object(self, obj: Obj) -> Obj:
-        """Adds an object to the document."""
-        self.objs.append(obj)
-        return obj
-
-    def add_page(self, page: Obj) -> Obj:
-        """Adds a page to the document and the list of objects."""
-        self.pages.append(page)
-        return self.add_object(page)
-
-    def __str__(self) -> str:
-        output = []
-        offsets = []
-        current_offset = 0
-
-        def add_line(line: str):
-            nonlocal current_offset
-            output.append(line)
-            current_offset += len(line) + 1  # Adding 1 for the newline character
-
-        # PDF header
-        add_line("%PDF-1.4")
-
-        # Add each object and track its byte offset
-        for obj in self.objs:
-            offsets.append(current_offset)
-            add_line(f"{obj.id} 0 obj")
-            add_line(str(obj))
-
-        # Cross-reference table
-        xref_start = current_offset
-        add_line("xref")
-        add_line(f"0 {len(offsets) + 1}")
-        add_line("0000000000 65535 f ")
-        for offset in offsets:
-            add_line(f"{offset:010} 00000 n ")
-
-        # Trailer and EOF
-        add_line("trailer")
-        add_line(f"<< /Size {len(offsets) + 1}\n/Root 1 0 R >>")
-        add_line("startxref")
-        add_line(str(xref_start))
-        add_line("%%EOF")
-
-        return "\n".join(output)
+class Writer:
+    """Writes a PDF to a binary stream as its objects are added.
+
+    Stream data is copied from the input files to the output without being
+    held in memory, and only the offset of each object is kept for the
+    cross-reference table, so memory use doesn't grow with the document.
+    """
+
+    def __init__(self, out):
+        self.out = out
+        self.offset = 0
+        self.offsets = {}
+        self.next_id = 1
+        self.write(b"%PDF-1.4\n")
+
+    def write(self, data: bytes):
+        self.out.write(data)
+        self.offset += len(data)
+
+    def reserve(self) -> int:
+        """Returns the number of an object to be written later."""
+        obj_id = self.next_id
+        self.next_id += 1
+        return obj_id
+
+    def begin(self, obj_id: int):
+        self.offsets[obj_id] = self.offset
+        self.write(f"{obj_id} 0 obj\n".encode("latin1"))
+
+    def add_object(self, d: dict, obj_id: int = None) -> int:
+        """Writes a dictionary object and returns its number."""
+        obj_id = obj_id or self.reserve()
+        self.begin(obj_id)
+        self.write(f"{Dict(d)}endobj\n".encode("latin1"))
+        return obj_id
+
+    def add_stream(self, d: dict, data: bytes) -> int:
+        """Writes a stream object and returns its number."""
+        obj_id = self.reserve()
+        self.begin(obj_id)
+        d = dict(d, Length=str(len(data)))
+        self.write(f"{Dict(d)}stream\n".encode("latin1"))
+        self.write(data)
+        self.write(b"\nendstream\nendobj\n")
+        return obj_id
+
+    def add_file_stream(self, d: dict, paths: list) -> int:
+        """Writes a stream object holding the concatenated contents of the
+        files and returns its number."""
+        sizes = [Path(path).stat().st_size for path in paths]
+        obj_id = self.reserve()
+        self.begin(obj_id)
+        d = dict(d, Length=str(sum(sizes)))
+        self.write(f"{Dict(d)}stream\n".encode("latin1"))
+        for path, size in zip(paths, sizes):
+            with open(path, "rb") as f:
+                shutil.copyfileobj(f, self.out)
+            self.offset += size
+        self.write(b"\nendstream\nendobj\n")
+        return obj_id
+
+    def close(self, root: int):
+        """Writes the cross-reference table and the trailer."""
+        xref_start = self.offset
+        lines = ["xref", f"0 {self.next_id}", "0000000000 65535 f "]
+        lines += [f"{self.offsets[i]:010} 00000 n " for i in range(1, self.next_id)]
+        lines += ["trailer", f"<< /Size {self.next_id}\n/Root {root} 0 R >>",
+                  "startxref", str(xref_start), "%%EOF"]
+        self.write(("\n".join(lines) + "\n").encode("latin1"))
+        self.out.flush()
 
 
 def ref(x: int) -> str:
@@ -129,41 +121,54 @@ def ref(x: int) -> str:
 
 
 def create_pdf(symboltable: str = "symboltable", pagefiles: list = None):
-    """Creates a PDF document from a symbol table and a list of page files."""
+    """Creates a PDF document from a symbol table and a list of page files,
+    writing it to stdout as it goes. Exits with status 1 if a file can't be
+    read once the output has started, leaving a truncated PDF."""
     pagefiles = pagefiles or glob.glob("page-*")
-    doc = Doc()
-
-    # Add catalog and outlines objects
-    catalog_obj = Obj({"Type": "/Catalog", "Outlines": ref(2), "Pages": ref(3)})
-    outlines_obj = Obj({"Type": "/Outlines", "Count": "0"})
-    pages_obj = Obj({"Type": "/Pages"})
-
-    doc.add_object(catalog_obj)
-    doc.add_object(outlines_obj)
-    doc.add_object(pages_obj)
+    doc = Writer(sys.stdout.buffer)
+
+    # The page tree is written last, once all the pages are known
+    catalog_id = doc.add_object({"Type": "/Catalog", "Outlines": ref(2), "Pages": ref(3)})
+    doc.add_object({"Type": "/Outlines", "Count": "0"})
+    pages_id = doc.reserve()
+
+    # With --page-clusters, `basename.clusters` gives the cluster of each page
+    # and the globals of a cluster (the global symbols followed by the
+    # cluster's own) are in `basename.sym.N`.
+    cluster_symds = []
+    page_clusters = []
+    clusters_file = Path(symboltable).with_suffix(".clusters") if symboltable else None
+    if clusters_file and clusters_file.exists():
+        try:
+            page_clusters = [int(x) for x in clusters_file.read_text().split()]
+            for c in range(max(page_clusters) + 1):
+                cluster_symds.append(doc.add_file_stream({}, [f"{symboltable}.{c}"]))
+        except (IOError, ValueError):
+            sys.stderr.write(f"Error reading page clusters: {clusters_file}\n")
+            sys.exit(1)
 
     # Read symbol table if it exists
     symd = None
-    if symboltable:
+    if symboltable and not page_clusters:
         try:
-            sym_file = Path(symboltable).read_bytes()
-            symd = doc.add_object(Obj({}, sym_file.decode("latin1")))
+            symd = doc.add_file_stream({}, [symboltable])
         except IOError:
             sys.stderr.write(f"Error reading symbol table: {symboltable}\n")
-            return
+            sys.exit(1)
 
-    page_objs = []
+    page_ids = []
     pagefiles.sort()
 
     for p in pagefiles:
         try:
-            contents = Path(p).read_bytes()
+            with open(p, "rb") as f:
+                header = f.read(27)
         except IOError:
             sys.stderr.write(f"Error reading page file: {p}\n")
             continue
 
         try:
-            width, height, xres, yres = struct.unpack(">IIII", contents[11:27])
+            width, height, xres, yres = struct.unpack(">IIII", header[11:27])
         except struct.error:
             sys.stderr.write(f"Error unpacking page file: {p}\n")
             continue
@@ -182,47 +187,51 @@ def create_pdf(symboltable: str = "symboltable", pagefiles: list = None):
             "BitsPerComponent": "1",
             "Filter": "/JBIG2Decode",
         }
-        if symd:
-            lexicon["DecodeParms"] = f"<< /JBIG2Globals {symd.id} 0 R >>"
-        xobj = Obj(
-            lexicon,
-            contents.decode("latin1"),
-        )
+        globals_obj = symd
+        if page_clusters:
+            # the page number is the suffix of the file name
+            page_no = int(p.rsplit(".", 1)[1])
+            globals_obj = cluster_symds[page_clusters[page_no]]
+        if globals_obj:
+            lexicon["DecodeParms"] = f"<< /JBIG2Globals {globals_obj} 0 R >>"
+        try:
+            xobj = doc.add_file_stream(lexicon, [p])
+        except IOError:
+            sys.stderr.write(f"Error reading page file: {p}\n")
+            sys.exit(1)
 
         # Create content stream for the page
-        contents_obj = Obj(
+        contents_obj = doc.add_stream(
             {},
-            f"q {float(width * 72) / xres} 0 0 {float(height * 72) / yres} 0 0 cm /Im1 Do Q",
+            f"q {float(width * 72) / xres} 0 0 {float(height * 72) / yres} 0 0 cm /Im1 Do Q".encode("latin1"),
         )
 
         # Create resource dictionary for the page
-        resources_obj = Obj(
-            {"ProcSet": "[/PDF /ImageB]", "XObject": f"<< /Im1 {xobj.id} 0 R >>"}
+        resources_obj = doc.add_object(
+            {"ProcSet": "[/PDF /ImageB]", "XObject": f"<< /Im1 {xobj} 0 R >>"}
         )
 
         # Create the page object
-        page_obj = Obj(
+        page_ids.append(doc.add_object(
             {
                 "Type": "/Page",
-                "Parent": "3 0 R",
+                "Parent": ref(pages_id),
                 "MediaBox": f"[ 0 0 {float(width * 72) / xres} {float(height * 72) / yres} ]",
-                "Contents": ref(contents_obj.id),
-                "Resources": ref(resources_obj.id),
+                "Contents": ref(contents_obj),
+                "Resources": ref(resources_obj),
             }
-        )
-
-        # Add objects to the document
-        for obj in (xobj, contents_obj, resources_obj, page_obj):
-            doc.add_object(obj)
+        ))
 
-        page_objs.append(page_obj)
-
-        # Update pages object
-        pages_obj.d.d["Count"] = str(len(page_objs))
-        pages_obj.d.d["Kids"] = "[" + " ".join([ref(x.id) for x in page_objs]) + "]"
-
-    # Output the final PDF document to stdout
-    sys.stdout.buffer.write(str(doc).encode("latin1"))
+    # Write the page tree and end the document
+    doc.add_object(
+        {
+            "Type": "/Pages",
+            "Count": str(len(page_ids)),
+            "Kids": "[" + " ".join([ref(x) for x in page_ids]) + "]",
+        },
+        pages_id,
+    )
+    doc.close(catalog_id)
 
 
 def usage(script, msg):
@@ -235,9 +244,14 @@ Usage:
   {script} -s [page.jb2]... > out.pdf
 
   Read symbol table from `basename.sym` and pages from `basename.[0-9]*`
+    (and, if `basename.clusters` exists, the symbol table of each cluster of
+    pages from `basename.sym.N`)
     if basename not given: symbol table from `symboltable`, pages from `page-*`
 
   -s: standalone mode (no global symbol table)
+
+  The PDF is written as the files are read. If one can't be read, the exit
+  status is 1 and the output is partial (and not a valid PDF).
 """)
     sys.exit(1)
 
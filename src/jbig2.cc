@@ -15,6 +15,9 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <deque>
+#include <future>
+#include <string>
 #include <vector>
 
 #include <sys/types.h>
@@ -27,6 +30,20 @@
 #else
 #include <unistd.h>
 #endif
+#ifndef _WIN32
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#endif
 
 #include <leptonica/allheaders.h>
 #if (LIBLEPT_MAJOR_VERSION == 1 && LIBLEPT_MINOR_VERSION >= 83) || LIBLEPT_MAJOR_VERSION > 1
@@ -34,6 +51,7 @@
 #endif
 
 #include "jbig2enc.h"
+#include "jbig2pdf.h"
 
 #if defined(WIN32)
 #define WINBINARY O_BINARY
@@ -51,14 +69,20 @@
 #define BW_THRESHOLD_MAX 255
 #define BW_LOCAL_THRESHOLD_DEF 200
 #define BW_GLOBAL_THRESHOLD_DEF 128
+// with --stream, each page is a window whose text region refers to every live
+// dictionary, so symbols are retired by default to keep that list short
+#define STREAM_RETIRE_DEF 100
 
 static void
 usage(const char *argv0) {
   fprintf(stderr, "Usage: %s [options] <input filenames...>\n", argv0);
+  fprintf(stderr, "       %s --daemon <socket> [--threads <n>] [-v]\n", argv0);
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "  -b <basename>: output file root name when using symbol coding\n");
   fprintf(stderr, "  -d --duplicate-line-removal: use TPGD in generic region coder\n");
   fprintf(stderr, "  -p --pdf: produce PDF ready data\n");
+  fprintf(stderr, "  --pdf-output <file>: write a PDF of the pages to file (- for stdout),\n"
+                  "                       instead of files for jbig2topdf.py (implies -p)\n");
   fprintf(stderr, "  -s --symbol-mode: use text region, not generic coder\n");
   fprintf(stderr, "  -t <threshold>: set classification threshold for symbol coder (def: %0.2f)\n", JBIG2_THRESHOLD_DEF);
   fprintf(stderr, "  -w <weight>: set classification weight for symbol coder (def: %0.2f)\n", JBIG2_WEIGHT_DEF);
@@ -73,14 +97,37 @@ usage(const char *argv0) {
   fprintf(stderr, "  -j --jpeg-output: write images from mixed input as JPEG\n");
   fprintf(stderr, "  -a --auto-thresh: use automatic thresholding in symbol encoder\n");
   fprintf(stderr, "  -D --dpi: force dpi\n");
+  fprintf(stderr, "  --online-auto-thresh: like -a, but unite symbols as each page is added\n");
+  fprintf(stderr, "  --native-classifier: use the built-in symbol classifier instead of Leptonica's\n");
+  fprintf(stderr, "  --local-classes: classify each page on its own first (needs --native-classifier)\n");
+  fprintf(stderr, "  --compare-classifiers: classify the pages with both classifiers and report how\n"
+                  "                         the results differ, instead of encoding them (exits\n"
+                  "                         with 20 if over 1%% of the symbols are classed differently)\n");
+  fprintf(stderr, "  --threads <n>: read and threshold up to n pages at once, encode pages on\n"
+                  "                 n threads (and, with --native-classifier, extract symbols\n"
+                  "                 from up to n pages at once)\n");
+  fprintf(stderr, "  --global-dicts <n>: split the global symbol dictionary in n parts, coded in parallel\n");
+  fprintf(stderr, "  --window <n>: write the output every n pages, each with its own symbol dictionary\n"
+                  "                (implies --native-classifier, not with -p or -a)\n");
+  fprintf(stderr, "  --stream: write each page as soon as it's read (the same as --window 1,\n"
+                  "            with --retire %d unless given)\n", STREAM_RETIRE_DEF);
+  fprintf(stderr, "  --sample <k>: build the global symbols from the first k pages, then write\n"
+                  "                each later page as soon as it's read (implies --native-classifier)\n");
+  fprintf(stderr, "  --retire <m>: with --window, forget symbols unused for m windows\n"
+                  "                (def: 0, never; with --stream, %d)\n", STREAM_RETIRE_DEF);
+  fprintf(stderr, "  --decode-weight <w>: trade w bytes of output for each dictionary pixel\n"
+                  "                      decoded per page (def: 0)\n");
+  fprintf(stderr, "  --page-clusters <n>: group the pages in n clusters, each with a dictionary of\n"
+                  "                       the symbols only its pages share (with -p, writes\n"
+                  "                       <basename>.sym.<n> and <basename>.clusters)\n");
   fprintf(stderr, "  --no-hash: disables use of hash function for automatic thresholding\n");
   fprintf(stderr, "  -V --version: version info\n");
   fprintf(stderr, "  -v: be verbose\n");
+  fprintf(stderr, "  --daemon <socket>: run the jobs sent to the Unix socket, on n threads (see\n"
+                  "                     jbig2.cc for the protocol; input @i is the i-th buffer\n"
+                  "                     sent with the job)\n");
 }
 
-static bool verbose = false;
-
-
 static void
 pixInfo(PIX *pix, const char *msg) {
   if (msg != NULL) fprintf(stderr, "%s ", msg);
@@ -138,7 +185,7 @@ static const char *segment_dilation_sequence = "d3.3";
 // -----------------------------------------------------------------------------
 
 static PIX*
-segment_image(PIX **ppixb, PIX *piximg) {
+segment_image(PIX **ppixb, PIX *piximg, bool verbose) {
   PIX *pixb = *ppixb;
   // Make a mask over the non-text (graphics) part of the input 1 bpp image
   // Do this by making a seed and mask, and filling the seed into the mask
@@ -157,9 +204,10 @@ segment_image(PIX **ppixb, PIX *piximg) {
   // side-effects the input binary mask.
   pixSubtract(pixb, pixb, pixd);
 
-  // Set up table to count pixels in the text and graphics masks
-  static l_int32 *tab = NULL;
-  if (tab == NULL) tab = makePixelSumTab8();
+  // Set up table to count pixels in the text and graphics masks. Pages are
+  // segmented on several threads at once, so the table is built by the
+  // (thread-safe) initialisation of the static.
+  static l_int32 *const tab = makePixelSumTab8();
 
   // If no graphics portion is found, destroy the graphics mask and return NULL
   l_int32  pcount;
@@ -212,10 +260,688 @@ segment_image(PIX **ppixb, PIX *piximg) {
   return pixd1;
 }
 
-int
-main(int argc, char **argv) {
+// -----------------------------------------------------------------------------
+// An input file mapped into memory. Large scans are decoded straight from the
+// page cache rather than being copied through stdio buffers first.
+// -----------------------------------------------------------------------------
+struct mapped_file {
+  const l_uint8 *data;  // NULL if the file isn't mapped
+  size_t size;
+  bool mapped;  // false if data belongs to someone else (see input_buffer)
+};
+
+// -----------------------------------------------------------------------------
+// Map a file for reading. Returns false (and pixRead and friends should be
+// used instead) if it can't be mapped, or on Windows.
+// -----------------------------------------------------------------------------
+static bool
+map_file(const char *filename, struct mapped_file *file) {
+  file->data = NULL;
+  file->size = 0;
+  file->mapped = false;
+#ifndef _WIN32
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *const data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+  // decoders read the file from start to end
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  file->data = (const l_uint8 *) data;
+  file->size = st.st_size;
+  file->mapped = true;
+#endif
+  return file->data != NULL;
+}
+
+static void
+unmap_file(struct mapped_file *file) {
+#ifndef _WIN32
+  if (file->mapped) munmap((void *) file->data, file->size);
+#endif
+  file->data = NULL;
+  file->size = 0;
+  file->mapped = false;
+}
+
+// -----------------------------------------------------------------------------
+// Parse a number in a PNM header, skipping whitespace and comments before it.
+// Returns false if there isn't one.
+// -----------------------------------------------------------------------------
+static bool
+pnm_number(const l_uint8 *data, size_t size, size_t *pos, int *value) {
+  for (;;) {
+    if (*pos >= size) return false;
+    const l_uint8 c = data[*pos];
+    if (c == '#') {
+      while (*pos < size && data[*pos] != '\n') (*pos)++;
+    } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+      (*pos)++;
+    } else {
+      break;
+    }
+  }
+
+  long n = 0;
+  const size_t start = *pos;
+  while (*pos < size && data[*pos] >= '0' && data[*pos] <= '9') {
+    n = n * 10 + (data[(*pos)++] - '0');
+    if (n > 1000000) return false;
+  }
+  *value = n;
+  return *pos > start;
+}
+
+// -----------------------------------------------------------------------------
+// Convert a raw PBM (P4) image to a PIX. The rows of a PBM are already 1 bpp,
+// most significant bit first, with 1 for black, so they only need padding to
+// whole words (and, on little endian machines, Leptonica's byte order within
+// each word). Returns NULL if it isn't a valid P4 image.
+// -----------------------------------------------------------------------------
+static PIX *
+pix_from_pbm(const l_uint8 *data, size_t size) {
+  if (size < 2 || data[0] != 'P' || data[1] != '4') return NULL;
+  size_t pos = 2;
+  int width, height;
+  if (!pnm_number(data, size, &pos, &width) ||
+      !pnm_number(data, size, &pos, &height) ||
+      width <= 0 || height <= 0) {
+    return NULL;
+  }
+  // a single whitespace character separates the header from the rows
+  pos++;
+  const size_t row_bytes = (width + 7) / 8;
+  if (pos > size || (size - pos) / row_bytes < (size_t) height) return NULL;
+
+  PIX *const pix = pixCreateNoInit(width, height, 1);
+  if (!pix) return NULL;
+  const int wpl = pixGetWpl(pix);
+  l_uint8 *row = (l_uint8 *) pixGetData(pix);
+  for (int y = 0; y < height; ++y) {
+    memcpy(row, data + pos + y * row_bytes, row_bytes);
+    memset(row + row_bytes, 0, wpl * 4 - row_bytes);
+    row += wpl * 4;
+  }
+  pixEndianByteSwap(pix);
+  pixSetPadBits(pix, 0);
+  return pix;
+}
+
+// -----------------------------------------------------------------------------
+// Decode a single image in memory
+// -----------------------------------------------------------------------------
+static PIX *
+decode_image(const l_uint8 *data, size_t size) {
+  PIX *pix = pix_from_pbm(data, size);
+  if (!pix) pix = pixReadMem(data, size);
+  return pix;
+}
+
+// -----------------------------------------------------------------------------
+// Read a single image file, from a mapping of it if possible.
+// -----------------------------------------------------------------------------
+static PIX *
+read_image(const char *filename) {
+  struct mapped_file file;
+  if (!map_file(filename, &file)) return pixRead(filename);
+
+  PIX *const pix = decode_image(file.data, file.size);
+  unmap_file(&file);
+  return pix;
+}
+
+// -----------------------------------------------------------------------------
+// How input images are turned into 1 bpp pages (see the options in usage)
+// -----------------------------------------------------------------------------
+struct read_options {
+  int dpi;
+  bool globalmode;
+  int bw_threshold;
+  bool up2, up4;
+  bool segment;
+  bool keep_thresholded;  // for -O
+  l_int32 img_fmt;
+  const char *img_ext;
+  const char *basename;
+  bool verbose;
+};
+
+// -----------------------------------------------------------------------------
+// An input page: a file or, for a multi-page TIFF, the image already read from
+// it
+// -----------------------------------------------------------------------------
+struct input_page {
+  const char *filename;
+  PIX *source;  // NULL if the file has one image, which is yet to be read
+  // for an input buffer (see input_buffer) with one image, the image data
+  const l_uint8 *data;
+  size_t size;
+  int pageno;  // the number of the page among all those read
+};
+
+// -----------------------------------------------------------------------------
+// The input pages are every image of every file named on the command line
+// -----------------------------------------------------------------------------
+struct input_pages {
+  char **files;
+  int nfiles;
+  int next_file;
+  // in daemon mode, the images sent with the job (or NULL)
+  const std::vector<std::string> *buffers;
+  // the current multi-page TIFF (and its mapping, if it's mapped), the number
+  // of images in it, the next one to read and its offset in the file
+  const char *current;
+  struct mapped_file current_map;
+  int numsubimages, subimage;
+  size_t offset;
+  int pageno;
+  bool verbose;
+};
+
+// -----------------------------------------------------------------------------
+// In daemon mode, an input named @n is the n-th image sent with the job, rather
+// than a file. Returns false if filename isn't one, and sets *error to the exit
+// code if it's invalid.
+// -----------------------------------------------------------------------------
+static bool
+input_buffer(const struct input_pages *inputs, const char *filename,
+             struct mapped_file *buffer, int *error) {
+  if (!inputs->buffers || filename[0] != '@') return false;
+  char *endptr;
+  const long n = strtol(filename + 1, &endptr, 10);
+  if (*endptr || endptr == filename + 1 || n < 0 ||
+      n >= (long) inputs->buffers->size()) {
+    fprintf(stderr, "Invalid input buffer \"%s\"\n", filename);
+    *error = 1;
+    return false;
+  }
+  const std::string &data = (*inputs->buffers)[n];
+  buffer->data = (const l_uint8 *) data.data();
+  buffer->size = data.size();
+  buffer->mapped = false;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Get the next input page. Returns false at the end or, setting *error to the
+// exit code, if a file can't be opened.
+//
+// The images of a multi-page TIFF are read here, in order, each starting from
+// the offset at which the last one ended. (pixReadTiff would walk the chain
+// of directories from the start of the file for every image.)
+// -----------------------------------------------------------------------------
+static bool
+next_input_page(struct input_pages *inputs, struct input_page *page,
+                int *error) {
+  if (inputs->subimage == inputs->numsubimages) {
+    if (inputs->next_file == inputs->nfiles) return false;
+    const char *filename = inputs->files[inputs->next_file++];
+    inputs->subimage = inputs->numsubimages = 0;
+    if (inputs->verbose) fprintf(stderr, "Processing \"%s\"...\n", filename);
+    struct mapped_file buffer;
+    const bool is_buffer = input_buffer(inputs, filename, &buffer, error);
+    if (*error) return false;
+    FILE *fp;
+#ifndef _WIN32
+    fp = is_buffer ? fmemopen((void *) buffer.data, buffer.size, "r") :
+                     lept_fopen(filename, "r");
+#else
+    fp = lept_fopen(filename, "r");
+#endif
+    if (fp == NULL) {
+      fprintf(stderr, "Unable to open \"%s\"\n", filename);
+      *error = 1;
+      return false;
+    }
+    l_int32 filetype;
+    findFileFormatStream(fp, &filetype);
+    const bool count_failed =
+      filetype==IFF_TIFF && tiffGetCount(fp, &inputs->numsubimages);
+    if (is_buffer) {
+      fclose(fp);
+    } else {
+      lept_fclose(fp);
+    }
+    if (count_failed) {
+      *error = 1;
+      return false;
+    }
+
+    if (inputs->numsubimages <= 1) {
+      inputs->numsubimages = 0;
+      page->filename = filename;
+      page->source = NULL;
+      page->data = is_buffer ? buffer.data : NULL;
+      page->size = is_buffer ? buffer.size : 0;
+      page->pageno = inputs->pageno++;
+      return true;
+    }
+    inputs->current = filename;
+    inputs->offset = 0;
+    if (is_buffer) {
+      inputs->current_map = buffer;
+    } else {
+      map_file(filename, &inputs->current_map);
+    }
+  }
+
+  page->filename = inputs->current;
+  page->data = NULL;
+  page->size = 0;
+  const struct mapped_file *const map = &inputs->current_map;
+  if (map->data) {
+    page->source = pixReadMemFromMultipageTiff(map->data, map->size,
+                                               &inputs->offset);
+  } else {
+    page->source = pixReadFromMultipageTiff(inputs->current, &inputs->offset);
+  }
+  if (!page->source) {
+    unmap_file(&inputs->current_map);
+    *error = 3;
+    return false;
+  }
+  page->pageno = inputs->pageno++;
+  inputs->subimage++;
+  // the offset is 0 after the last image
+  if (inputs->offset == 0) inputs->subimage = inputs->numsubimages;
+  if (inputs->subimage == inputs->numsubimages) unmap_file(&inputs->current_map);
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// A page, read and thresholded
+// -----------------------------------------------------------------------------
+struct read_page_result {
+  PIX *pixt;  // the 1 bpp page, or NULL if no text was found on it
+  PIX *thresholded;  // with keep_thresholded, the page before segmentation
+  int error;  // if not 0, the page couldn't be read and this is the exit code
+};
+
+// -----------------------------------------------------------------------------
+// Read an input page and convert it to 1 bpp, removing the graphics (which are
+// written out) with -S. This only uses Leptonica, so pages may be read on
+// several threads at once.
+// -----------------------------------------------------------------------------
+static struct read_page_result
+read_page(const struct read_options *options, struct input_page input) {
+  struct read_page_result ret;
+  ret.pixt = ret.thresholded = NULL;
+  ret.error = 0;
+
+  PIX *source = input.source;
+  if (!source) {
+    source = input.data ? decode_image(input.data, input.size) :
+                          read_image(input.filename);
+  }
+
+  if (!source) {
+    ret.error = 3;
+    return ret;
+  }
+  if (options->dpi != 0 && source->xres == 0 && source->yres == 0) {
+    source->xres = options->dpi;
+    source->yres = options->dpi;
+  }
+  if (options->verbose)
+    pixInfo(source, "source image:");
+
+  PIX *pixl, *gray, *adapt, *pixt;
+  if ((pixl = pixRemoveColormap(source, REMOVE_CMAP_BASED_ON_SRC)) == NULL) {
+    fprintf(stderr, "Failed to remove colormap from %s\n", input.filename);
+    pixDestroy(&source);
+    ret.error = 1;
+    return ret;
+  }
+  pixDestroy(&source);
+
+  if (pixl->d > 1) {
+    if (pixl->d > 8) {
+      gray = pixConvertRGBToGrayFast(pixl);
+      if (!gray) {
+        pixDestroy(&pixl);
+        ret.error = 1;
+        return ret;
+      }
+    } else if (pixl->d == 4 || pixl->d == 8) {
+      gray = pixClone(pixl);
+    } else {
+      fprintf(stderr, "Unsupported input image depth: %d\n", pixl->d);
+      pixDestroy(&pixl);
+      ret.error = 1;
+      return ret;
+    }
+    if (!options->globalmode) {
+      adapt = pixCleanBackgroundToWhite(gray, NULL, NULL, 1.0, 90, 190);
+    } else {
+      adapt = pixClone(gray);
+    }
+    pixDestroy(&gray);
+    if (options->up2) {
+      pixt = pixScaleGray2xLIThresh(adapt, options->bw_threshold);
+    } else if (options->up4) {
+      pixt = pixScaleGray4xLIThresh(adapt, options->bw_threshold);
+    } else {
+      pixt = pixThresholdToBinary(adapt, options->bw_threshold);
+    }
+    pixDestroy(&adapt);
+  } else {
+    pixt = pixClone(pixl);
+  }
+  if (!pixt) {
+    fprintf(stderr, "Failed to convert input image to binary\n");
+    pixDestroy(&pixl);
+    ret.error = 1;
+    return ret;
+  }
+  if (options->verbose)
+    pixInfo(pixt, "thresholded image:");
+
+  if (options->keep_thresholded) ret.thresholded = pixClone(pixt);
+
+  if (options->segment && pixl->d > 1) {
+    // If no text is found, pixt is destroyed
+    PIX *graphics = segment_image(&pixt, pixl, options->verbose);
+    if (graphics) {
+      if (options->verbose)
+        pixInfo(graphics, "graphics image:");
+      char *filename;
+      asprintf(&filename, "%s.%04d.%s", options->basename, input.pageno,
+               options->img_ext);
+      pixWrite(filename, graphics, options->img_fmt);
+      free(filename);
+      pixDestroy(&graphics);
+    } else if (options->verbose) {
+      fprintf(stderr, "%s: no graphics found in input image\n", input.filename);
+    }
+    if (pixt == NULL) {
+      fprintf(stderr, "%s: no text portion found in input image\n",
+              input.filename);
+    }
+  }
+
+  pixDestroy(&pixl);
+  ret.pixt = pixt;
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// Where the output of a run goes
+// -----------------------------------------------------------------------------
+struct output {
+  int fd;  // stdout or, in daemon mode, the connection of the job
+  // in daemon mode, the output is sent in chunks, each prefixed with its
+  // length (see run_daemon)
+  bool framed;
+  bool failed;  // true once writing has failed
+  // with --pdf-output, the PDF which is written as the pages are encoded
+  struct jbig2pdf *pdf;  // NULL if PDF mode writes files for jbig2topdf.py
+  int globals;  // the JBIG2Globals object of the pages being written, or 0
+};
+
+static bool
+write_all(int fd, const void *data, size_t length) {
+  const uint8_t *p = (const uint8_t *) data;
+  while (length) {
+    const int n = write(fd, p, length);
+    if (n <= 0) return false;
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Write to the output
+// -----------------------------------------------------------------------------
+static void
+emit(struct output *out, const void *data, size_t length) {
+  if (out->failed || !length) return;
+  if (out->framed) {
+    const uint8_t header[4] = {(uint8_t) (length >> 24), (uint8_t) (length >> 16),
+                               (uint8_t) (length >> 8), (uint8_t) length};
+    if (!write_all(out->fd, header, sizeof(header))) out->failed = true;
+  }
+  if (!out->failed && !write_all(out->fd, data, length)) out->failed = true;
+}
+
+// jbig2pdf_sink for a PDF written to the output
+static bool
+emit_sink(void *arg, const uint8_t *data, size_t length) {
+  struct output *const out = (struct output *) arg;
+  emit(out, data, length);
+  return !out->failed;
+}
+
+// -----------------------------------------------------------------------------
+// Write data, followed by data2, to a new file. On failure, the output is
+// marked as failed.
+// -----------------------------------------------------------------------------
+static void
+write_file(struct output *out, const char *filename, const uint8_t *data,
+           int length, const uint8_t *data2 = NULL, int length2 = 0) {
+  const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | WINBINARY, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to open \"%s\"\n", filename);
+    out->failed = true;
+    return;
+  }
+  if (!write_all(fd, data, length) || !write_all(fd, data2, length2)) {
+    fprintf(stderr, "Unable to write \"%s\"\n", filename);
+    out->failed = true;
+  }
+  close(fd);
+}
+
+// -----------------------------------------------------------------------------
+// Write the output for a page: to the PDF with --pdf-output, to its own file in
+// PDF mode, otherwise to stdout. ret is freed.
+// -----------------------------------------------------------------------------
+static void
+write_page(uint8_t *ret, int length, int page, bool pdfmode,
+           struct output *out, const char *basename) {
+  if (out->pdf) {
+    if (!jbig2pdf_add_page(out->pdf, ret, length, out->globals)) {
+      out->failed = true;
+    }
+  } else if (pdfmode) {
+    char *filename;
+    asprintf(&filename, "%s.%04d", basename, page);
+    write_file(out, filename, ret, length);
+    free(filename);
+  } else {
+    emit(out, ret, length);
+  }
+  free(ret);
+}
+
+// -----------------------------------------------------------------------------
+// Complete the pages added so far and write the symbol table and the pages.
+// -----------------------------------------------------------------------------
+static void
+write_symbols_and_pages(struct jbig2ctx *ctx, int num_pages, int threads,
+                        bool pdfmode, struct output *out,
+                        const char *basename) {
+  uint8_t *ret;
+  int length;
+  ret = jbig2_pages_complete(ctx, &length);
+  if (!ret) {
+    out->failed = true;
+    return;
+  }
+  const int nclusters = jbig2_page_clusters(ctx);
+  // the JBIG2Globals object of each page cluster
+  std::vector<int> cluster_globals;
+  if (out->pdf) {
+    out->globals = jbig2pdf_add_globals(out->pdf, ret, length);
+    if (!out->globals) out->failed = true;
+    for (int c = 0; c < nclusters; ++c) {
+      int cluster_length;
+      uint8_t *const cluster = jbig2_cluster_symbols(ctx, c, &cluster_length);
+      cluster_globals.push_back(jbig2pdf_add_globals(out->pdf, ret, length,
+                                                     cluster, cluster_length));
+      free(cluster);
+      if (!cluster_globals.back()) out->failed = true;
+    }
+  } else if (pdfmode) {
+    char *filename;
+    asprintf(&filename, "%s.sym", basename);
+    write_file(out, filename, ret, length);
+    free(filename);
+  } else {
+    emit(out, ret, length);
+  }
+
+  // In PDF mode, the globals of the pages of a cluster are the global symbols
+  // followed by the cluster's own, and the cluster of each page is listed in
+  // basename.clusters for jbig2topdf.py.
+  if (pdfmode && !out->pdf && nclusters) {
+    for (int c = 0; c < nclusters; ++c) {
+      int cluster_length;
+      uint8_t *const cluster = jbig2_cluster_symbols(ctx, c, &cluster_length);
+      char *filename;
+      asprintf(&filename, "%s.sym.%d", basename, c);
+      write_file(out, filename, ret, length, cluster, cluster_length);
+      free(filename);
+      free(cluster);
+    }
+
+    char *filename;
+    asprintf(&filename, "%s.clusters", basename);
+    FILE *const clusters = fopen(filename, "w");
+    if (clusters) {
+      for (int i = 0; i < num_pages; ++i) {
+        fprintf(clusters, "%d\n", jbig2_page_cluster(ctx, i));
+      }
+      if (fclose(clusters)) out->failed = true;
+    } else {
+      fprintf(stderr, "Unable to open \"%s\"\n", filename);
+      out->failed = true;
+    }
+    free(filename);
+  } else if (pdfmode && !out->pdf) {
+    // so that jbig2topdf.py doesn't pick up the clusters of an earlier run
+    char *filename;
+    asprintf(&filename, "%s.clusters", basename);
+    remove(filename);
+    free(filename);
+  }
+  free(ret);
+
+  // with more than one thread, encode all the pages first and then write them
+  std::vector<uint8_t *> pages;
+  std::vector<int> lengths;
+  if (threads > 1) {
+    pages.resize(num_pages);
+    lengths.resize(num_pages);
+    jbig2_produce_all_pages(ctx, threads, pages.data(), lengths.data());
+  }
+
+  for (int i = 0; i < num_pages; ++i) {
+    if (threads > 1) {
+      ret = pages[i];
+      length = lengths[i];
+    } else {
+      ret = jbig2_produce_page(ctx, i, -1, -1, &length);
+    }
+    const int global_globals = out->globals;
+    // (without --pdf-output, jbig2topdf.py reads the clusters from a file)
+    if (out->pdf && nclusters) {
+      out->globals = cluster_globals[jbig2_page_cluster(ctx, i)];
+    }
+    write_page(ret, length, i, pdfmode, out, basename);
+    out->globals = global_globals;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// A page encoded in generic mode
+// -----------------------------------------------------------------------------
+struct generic_page {
+  uint8_t *data;
+  int length;
+};
+
+// -----------------------------------------------------------------------------
+// Encode a page in generic mode. This runs on a worker thread and takes
+// ownership of pixt.
+// -----------------------------------------------------------------------------
+static struct generic_page
+encode_generic_page(PIX *pixt, int page, bool full_headers,
+                    bool duplicate_line_removal) {
+  struct generic_page ret;
+  ret.data = jbig2_encode_generic_page(pixt, full_headers, page, 0, 0,
+                                       duplicate_line_removal, &ret.length);
+  pixDestroy(&pixt);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// Wait for the oldest page being encoded in generic mode and write it out.
+// -----------------------------------------------------------------------------
+static void
+write_generic_page(std::deque<std::future<struct generic_page> > *pending,
+                   int page, bool pdfmode, struct output *out,
+                   const char *basename) {
+  struct generic_page encoded = pending->front().get();
+  pending->pop_front();
+  write_page(encoded.data, encoded.length, page, pdfmode, out, basename);
+}
+
+// -----------------------------------------------------------------------------
+// When a run stops early, wait for the pages still being read or encoded and
+// free them, and unmap the multi-page TIFF being read, if any. (In daemon mode,
+// anything left behind would leak for the life of the process.)
+// -----------------------------------------------------------------------------
+static void
+discard_pending(std::deque<std::future<struct read_page_result> > *reading,
+                std::deque<std::future<struct generic_page> > *generic_pages,
+                struct input_pages *inputs) {
+  // a deferred read only runs (and frees the page it was given) when waited on
+  while (!reading->empty()) {
+    struct read_page_result page = reading->front().get();
+    reading->pop_front();
+    pixDestroy(&page.pixt);
+    pixDestroy(&page.thresholded);
+  }
+  while (!generic_pages->empty()) {
+    struct generic_page encoded = generic_pages->front().get();
+    generic_pages->pop_front();
+    free(encoded.data);
+  }
+  unmap_file(&inputs->current_map);
+}
+
+// -----------------------------------------------------------------------------
+// Finish the PDF, if there is one, and return the exit code of the run: status
+// if it's an error, otherwise 1 if the output couldn't be written.
+// -----------------------------------------------------------------------------
+static int
+finish_output(struct output *out, int pdf_fd, int status) {
+  if (out->pdf && !jbig2pdf_close(out->pdf)) out->failed = true;
+  out->pdf = NULL;
+  if (pdf_fd >= 0) close(pdf_fd);
+  if (status) return status;
+  return out->failed ? 1 : 0;
+}
+
+// -----------------------------------------------------------------------------
+// Run the encoder with the given command line, writing to out. This is main,
+// apart from daemon mode, where each job is a run.
+//
+// buffers: in daemon mode, the images sent with the job, which are named @0,
+//          @1, ... on the command line. Otherwise NULL.
+// -----------------------------------------------------------------------------
+static int
+run(int argc, char **argv, struct output *out,
+    const std::vector<std::string> *buffers) {
   bool duplicate_line_removal = false;
   bool pdfmode = false;
+  const char *pdf_output_file = NULL;
   bool globalmode = false;
   int bw_threshold = BW_LOCAL_THRESHOLD_DEF;
   float threshold = JBIG2_THRESHOLD_DEF;
@@ -225,12 +951,26 @@ main(int argc, char **argv) {
   bool up2 = false, up4 = false;
   const char *output_threshold_image = NULL;
   const char *basename = "output";
+  bool basename_given = false;
   l_int32 img_fmt = IFF_PNG;
   const char *img_ext = "png";
   bool segment = false;
   bool auto_thresh = false;
+  bool online_thresh = false;
+  bool native_classifier = false;
+  bool local_classes = false;
+  bool compare_classifiers = false;
+  int threads = 1;
+  int global_dicts = 1;
+  int window = 0;
+  int retire = -1;  // -1 until given
+  bool stream = false;
+  int sample = 0;
+  float decode_weight = 0;
+  int page_clusters = 1;
   bool hash = true;
   int dpi = 0;
+  bool verbose = false;
   int i;
 
   #ifdef WIN32
@@ -265,6 +1005,7 @@ main(int argc, char **argv) {
     if (strcmp(argv[i], "-b") == 0 ||
         strcmp(argv[i], "--basename") == 0) {
       basename = argv[i+1];
+      basename_given = true;
       i++;
       continue;
     }
@@ -281,6 +1022,13 @@ main(int argc, char **argv) {
       continue;
     }
 
+    if (strcmp(argv[i], "--pdf-output") == 0) {
+      pdf_output_file = argv[i+1];
+      pdfmode = true;
+      i++;
+      continue;
+    }
+
     if (strcmp(argv[i], "-s") == 0 ||
         strcmp(argv[i], "--symbol-mode") == 0) {
       symbol_mode = true;
@@ -397,6 +1145,26 @@ main(int argc, char **argv) {
       continue;
     }
 
+    if (strcmp(argv[i], "--online-auto-thresh") == 0) {
+      online_thresh = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--native-classifier") == 0) {
+      native_classifier = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--local-classes") == 0) {
+      local_classes = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--compare-classifiers") == 0) {
+      compare_classifiers = true;
+      continue;
+    }
+
     if (strcmp(argv[i], "--no-hash") == 0) {
       hash = false;
       continue;
@@ -425,6 +1193,129 @@ main(int argc, char **argv) {
       continue;
     }
 
+    if (strcmp(argv[i], "--global-dicts") == 0) {
+      char *endptr;
+      long t_dicts = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (t_dicts <= 0 || t_dicts > 64) {
+        fprintf(stderr, "Invalid number of global dictionaries: (1..64)\n");
+        return 14;
+      }
+      global_dicts = (int)t_dicts;
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--window") == 0) {
+      char *endptr;
+      long t_window = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (t_window <= 0 || t_window > 1000000) {
+        fprintf(stderr, "Invalid window size: (1..1000000)\n");
+        return 15;
+      }
+      window = (int)t_window;
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--stream") == 0) {
+      stream = true;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--decode-weight") == 0) {
+      char *endptr;
+      decode_weight = strtod(argv[i+1], &endptr);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse float value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (decode_weight < 0) {
+        fprintf(stderr, "Invalid decode weight (must not be negative)\n");
+        return 18;
+      }
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--page-clusters") == 0) {
+      char *endptr;
+      long t_clusters = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (t_clusters <= 0 || t_clusters > 1000) {
+        fprintf(stderr, "Invalid number of page clusters: (1..1000)\n");
+        return 19;
+      }
+      page_clusters = (int)t_clusters;
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--sample") == 0) {
+      char *endptr;
+      long t_sample = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (t_sample <= 0 || t_sample > 1000000) {
+        fprintf(stderr, "Invalid sample size: (1..1000000)\n");
+        return 17;
+      }
+      sample = (int)t_sample;
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--retire") == 0) {
+      char *endptr;
+      long t_retire = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (t_retire < 0 || t_retire > 1000000) {
+        fprintf(stderr, "Invalid number of windows: (0..1000000)\n");
+        return 16;
+      }
+      retire = (int)t_retire;
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--threads") == 0) {
+      char *endptr;
+      long t_threads = strtol(argv[i+1], &endptr, 10);
+      if (*endptr) {
+        fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+        usage(argv[0]);
+        return 1;
+      }
+      if (t_threads <= 0 || t_threads > 1024) {
+        fprintf(stderr, "Invalid number of threads: (1..1024)\n");
+        return 13;
+      }
+      threads = (int)t_threads;
+      i++;
+      continue;
+    }
+
     break;
   }
 
@@ -445,134 +1336,230 @@ main(int argc, char **argv) {
     return 6;
   }
 
+  if (stream) window = 1;
+  if (retire < 0) retire = stream ? STREAM_RETIRE_DEF : 0;
+  if (window && (pdfmode || auto_thresh || online_thresh)) {
+    fprintf(stderr, "--window can't be used with -p or auto thresholding\n");
+    return 7;
+  }
+  if (sample && (window || auto_thresh || online_thresh)) {
+    fprintf(stderr, "--sample can't be used with --window, --stream or auto thresholding\n");
+    return 7;
+  }
+  if (page_clusters > 1 && (window || sample)) {
+    fprintf(stderr, "--page-clusters can't be used with --window, --stream or --sample\n");
+    return 7;
+  }
+  if (window || sample) native_classifier = true;
+  // A daemon job's only output is what is sent back to the client. Files would
+  // go in the daemon's directory, and jobs would overwrite each other's.
+  const bool pdf_to_output = pdf_output_file && strcmp(pdf_output_file, "-") == 0;
+  if (buffers && (basename_given || output_threshold_image || segment ||
+                  (pdfmode && !pdf_to_output))) {
+    fprintf(stderr, "-b, -O, -S, -p and --pdf-output to a file can't be used in "
+                    "daemon jobs (--pdf-output - can)\n");
+    return 7;
+  }
+  if (compare_classifiers) symbol_mode = true;
+
+  out->pdf = NULL;
+  out->globals = 0;
+  int pdf_fd = -1;
+  if (pdf_to_output) {
+    out->pdf = jbig2pdf_open_sink(emit_sink, out);
+  } else if (pdf_output_file) {
+    pdf_fd = open(pdf_output_file, O_WRONLY | O_CREAT | O_TRUNC | WINBINARY, 0644);
+    if (pdf_fd < 0) {
+      fprintf(stderr, "Unable to open \"%s\"\n", pdf_output_file);
+      return 1;
+    }
+    out->pdf = jbig2pdf_open(pdf_fd);
+  }
+
   struct jbig2ctx *ctx = jbig2_init(threshold, weight, 0, 0,
                          !pdfmode, refine ? 10 : -1);
-  int pageno = -1;
-
-  int numsubimages=0, subimage=0, num_pages = 0;
-  while (i < argc) {
-    if (subimage==numsubimages) {
-      subimage = numsubimages = 0;
-      FILE *fp;
-      if (verbose) fprintf(stderr, "Processing \"%s\"...\n", argv[i]);
-      if ((fp=lept_fopen(argv[i], "r"))==NULL) {
-        fprintf(stderr, "Unable to open \"%s\"\n", argv[i]);
-        return 1;
-      }
-      l_int32 filetype;
-      findFileFormatStream(fp, &filetype);
-      if (filetype==IFF_TIFF && tiffGetCount(fp, &numsubimages)) {
-        return 1;
-      }
-      lept_fclose(fp);
+  if (native_classifier) jbig2_use_native_classifier(ctx, true);
+  if (local_classes) jbig2_use_local_classes(ctx, true);
+  jbig2_set_ingest_threads(ctx, threads);
+  if (online_thresh) jbig2enc_auto_threshold_online(ctx, hash);
+  if (window) jbig2_set_window(ctx, retire);
+  if (sample) jbig2_stream_after_sample(ctx, true);
+  jbig2_set_decode_cost_weight(ctx, decode_weight);
+  jbig2_set_page_clusters(ctx, page_clusters);
+  struct jbig2_classifier_check *check =
+    compare_classifiers ? jbig2_classifier_check_init(threshold, weight) : NULL;
+  // Pages are read and thresholded on up to threads threads at once, ahead of
+  // the encoder, which takes them in order. With one thread, each page is read
+  // when the encoder wants it.
+  struct read_options options;
+  options.dpi = dpi;
+  options.globalmode = globalmode;
+  options.bw_threshold = bw_threshold;
+  options.up2 = up2;
+  options.up4 = up4;
+  options.segment = segment;
+  options.keep_thresholded = output_threshold_image != NULL;
+  options.img_fmt = img_fmt;
+  options.img_ext = img_ext;
+  options.basename = basename;
+  options.verbose = verbose;
+  struct input_pages inputs;
+  memset(&inputs, 0, sizeof(inputs));
+  inputs.files = argv + i;
+  inputs.nfiles = argc - i;
+  inputs.buffers = buffers;
+  inputs.verbose = verbose;
+  const std::launch launch =
+    threads > 1 ? std::launch::async : std::launch::deferred;
+  std::deque<std::future<struct read_page_result> > reading;
+  bool more_input = true;
+  int input_error = 0;
+
+  int num_pages = 0;
+  // In generic mode, several pages are a JBIG2 file with a page per image or,
+  // with -p, a file per page. Up to threads pages are encoded at once, and
+  // written in order. A single page is written as it always was, unless it
+  // goes in a PDF.
+  bool multipage = inputs.nfiles > 1 || out->pdf;
+  std::deque<std::future<struct generic_page> > generic_pages;
+  int generic_written = 0;
+  for (;;) {
+    while (more_input && reading.size() < (size_t) threads) {
+      struct input_page input;
+      more_input = next_input_page(&inputs, &input, &input_error);
+      if (!more_input) break;
+      if (inputs.numsubimages > 1) multipage = true;
+      reading.push_back(std::async(launch, read_page, &options, input));
     }
-
-    PIX *source;
-    if (numsubimages<=1) {
-      source = pixRead(argv[i]);
-      numsubimages = 0;
-    } else {
-      source = pixReadTiff(argv[i], subimage++);
+    if (reading.empty()) break;
+    struct read_page_result page = reading.front().get();
+    reading.pop_front();
+    if (page.error) {
+      discard_pending(&reading, &generic_pages, &inputs);
+      if (check) jbig2_classifier_check_destroy(check);
+      jbig2_destroy(ctx);
+      return finish_output(out, pdf_fd, page.error);
     }
 
-    if (dpi != 0 && source->xres == 0 && source->yres == 0) {
-      source->xres = dpi;
-      source->yres = dpi;
+    if (page.thresholded) {
+      pixWrite(output_threshold_image, page.thresholded, IFF_PNG);
+      pixDestroy(&page.thresholded);
     }
+    PIX *pixt = page.pixt;
+    if (!pixt) continue;
 
-    if (!source) return 3;
-    if (verbose)
-      pixInfo(source, "source image:");
-
-    PIX *pixl, *gray, *adapt, *pixt;
-    if ((pixl = pixRemoveColormap(source, REMOVE_CMAP_BASED_ON_SRC)) == NULL) {
-      fprintf(stderr, "Failed to remove colormap from %s\n", argv[i]);
-      return 1;
-    }
-    pixDestroy(&source);
-    pageno++;
-
-    if (pixl->d > 1) {
-      if (pixl->d > 8) {
-        gray = pixConvertRGBToGrayFast(pixl);
-        if (!gray) return 1;
-      } else if (pixl->d == 4 || pixl->d == 8) {
-        gray = pixClone(pixl);
-      } else {
-        fprintf(stderr, "Unsupported input image depth: %d\n", pixl->d);
-        return 1;
-      }
-      if (!globalmode) {
-        adapt = pixCleanBackgroundToWhite(gray, NULL, NULL, 1.0, 90, 190);
-      } else {
-        adapt = pixClone(gray);
-      }
-      pixDestroy(&gray);
-      if (up2) {
-        pixt = pixScaleGray2xLIThresh(adapt, bw_threshold);
-      } else if (up4) {
-        pixt = pixScaleGray4xLIThresh(adapt, bw_threshold);
-      } else {
-        pixt = pixThresholdToBinary(adapt, bw_threshold);
-      }
-      pixDestroy(&adapt);
-    } else {
-      pixt = pixClone(pixl);
-    }
-    if (!pixt) {
-      fprintf(stderr, "Failed to convert input image to binary\n");
-      pixDestroy(&pixl);  // only alive here when segment==true && d>1
-      return 1;
+    if (check) {
+      jbig2_classifier_check_add_page(check, pixt);
+      pixDestroy(&pixt);
+      num_pages++;
+      continue;
     }
-    if (verbose)
-      pixInfo(pixt, "thresholded image:");
-
-    if (output_threshold_image) {
-      pixWrite(output_threshold_image, pixt, IFF_PNG);
-    }
-
-    if (segment && pixl->d > 1) {
-      // If no text is found, pixt is destroyed
-      PIX *graphics = segment_image(&pixt, pixl);
-      pixDestroy(&pixl);  // if pixt == NULL, the loop exits at 'continue'
-      if (graphics) {
-        if (verbose)
-          pixInfo(graphics, "graphics image:");
-        char *filename;
-        asprintf(&filename, "%s.%04d.%s", basename, pageno, img_ext);
-        pixWrite(filename, graphics, img_fmt);
-        free(filename);
-        pixDestroy(&graphics);
-      } else if (verbose) {
-        fprintf(stderr, "%s: no graphics found in input image\n", argv[i]);
+
+    if (!symbol_mode && multipage) {
+      if (num_pages == 0 && !pdfmode) {
+        int length;
+        uint8_t *ret = jbig2_generic_header(-1, &length);
+        emit(out, ret, length);
+        free(ret);
       }
-      if (pixt == NULL) {
-        fprintf(stderr, "%s: no text portion found in input image\n", argv[i]);
-        i++;
-        continue;
+      if (generic_pages.size() >= (size_t) threads) {
+        write_generic_page(&generic_pages, generic_written++, pdfmode, out,
+                           basename);
       }
+      generic_pages.push_back(std::async(std::launch::async, encode_generic_page,
+                                         pixt, num_pages, !pdfmode,
+                                         duplicate_line_removal));
+      num_pages++;
+      continue;
     }
 
-    pixDestroy(&pixl);
-
     if (!symbol_mode) {
       int length;
       uint8_t *ret;
       ret = jbig2_encode_generic(pixt, !pdfmode, 0, 0, duplicate_line_removal,
                                  &length);
-      write(1, ret, length);
+      emit(out, ret, length);
       free(ret);
       pixDestroy(&pixt);
       jbig2_destroy(ctx);
-      return 0;
+      return finish_output(out, pdf_fd, 0);
     }
 
-    jbig2_add_page(ctx, pixt);
+    if (stream) {
+      int length;
+      uint8_t *ret = jbig2_stream_page(ctx, pixt, &length);
+      emit(out, ret, length);
+      free(ret);
+    } else if (sample && num_pages >= sample) {
+      // The sample is written once it's known that there are pages after it,
+      // which are then streamed.
+      if (num_pages == sample) {
+        jbig2_split_global_dictionary(ctx, global_dicts);
+        write_symbols_and_pages(ctx, num_pages, threads, pdfmode, out, basename);
+      }
+      int length;
+      uint8_t *ret = jbig2_stream_page(ctx, pixt, &length);
+      write_page(ret, length, num_pages, pdfmode, out, basename);
+    } else {
+      jbig2_add_page(ctx, pixt);
+    }
     pixDestroy(&pixt);
     num_pages++;
-    if (subimage==numsubimages) {
-      i++;
+    if (window && !stream && num_pages % window == 0) {
+      int length;
+      uint8_t *ret = jbig2_flush_window(ctx, false, &length);
+      emit(out, ret, length);
+      free(ret);
+    }
+  }
+  if (input_error) {
+    discard_pending(&reading, &generic_pages, &inputs);
+    if (check) jbig2_classifier_check_destroy(check);
+    jbig2_destroy(ctx);
+    return finish_output(out, pdf_fd, input_error);
+  }
+
+  if (check) {
+    struct jbig2_classifier_comparison result;
+    jbig2_classifier_check_result(check, &result);
+    jbig2_classifier_check_destroy(check);
+    jbig2_destroy(ctx);
+    const double percent =
+      result.components ? 100.0 * result.different_class / result.components : 0;
+    fprintf(stderr, "%d pages, %d symbols: Leptonica made %d classes in %.3fs, "
+                    "the native classifier %d in %.3fs\n",
+            result.pages, result.components, result.leptonica_templates,
+            result.leptonica_seconds, result.native_templates,
+            result.native_seconds);
+    fprintf(stderr, "%d symbols (%.2f%%) classed differently, %d more placed "
+                    "differently (by up to %d pixels)\n",
+            result.different_class, percent, result.different_place,
+            result.max_offset);
+    return finish_output(out, pdf_fd, percent > 1.0 ? 20 : 0);
+  }
+
+  if (!symbol_mode) {
+    while (!generic_pages.empty()) {
+      write_generic_page(&generic_pages, generic_written++, pdfmode, out,
+                           basename);
+    }
+    if (!pdfmode && num_pages) {
+      int length;
+      uint8_t *ret = jbig2_generic_trailer(num_pages, &length);
+      emit(out, ret, length);
+      free(ret);
     }
+    jbig2_destroy(ctx);
+    return finish_output(out, pdf_fd, 0);
+  }
+
+  if (window) {
+    int length;
+    uint8_t *ret = jbig2_flush_window(ctx, true, &length);
+    emit(out, ret, length);
+    free(ret);
+    jbig2_destroy(ctx);
+    return finish_output(out, pdf_fd, 0);
   }
 
   if (auto_thresh) {
@@ -583,39 +1570,262 @@ main(int argc, char **argv) {
     }
   }
 
-  uint8_t *ret;
-  int length;
-  ret = jbig2_pages_complete(ctx, &length);
-  if (pdfmode) {
-    char *filename;
-    asprintf(&filename, "%s.sym", basename);
-    const int fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT | WINBINARY, 0600);
-    free(filename);
-    if (fd < 0) abort();
-    write(fd, ret, length);
-    close(fd);
+  if (!sample || num_pages <= sample) {
+    // the whole document is in the sample, so it's written as usual
+    if (sample) jbig2_stream_after_sample(ctx, false);
+    jbig2_split_global_dictionary(ctx, global_dicts);
+    write_symbols_and_pages(ctx, num_pages, threads, pdfmode, out, basename);
   } else {
-    write(1, ret, length);
+    int length;
+    uint8_t *ret = jbig2_stream_trailer(ctx, &length);
+    emit(out, ret, length);
+    free(ret);
   }
-  free(ret);
 
-  for (int i = 0; i < num_pages; ++i) {
-    ret = jbig2_produce_page(ctx, i, -1, -1, &length);
-    if (pdfmode) {
-      char *filename;
-      asprintf(&filename, "%s.%04d", basename, i);
-      const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | WINBINARY, 0600);
-      free(filename);
-      if (fd < 0) abort();
-      write(fd, ret, length);
-      close(fd);
-    } else {
-      write(1, ret, length);
+  jbig2_destroy(ctx);
+  return finish_output(out, pdf_fd, 0);
+}
+
+#ifndef _WIN32
+// -----------------------------------------------------------------------------
+// Daemon mode: jobs are sent over a Unix domain socket, a connection per job,
+// and run on a pool of worker threads. This saves the start up of a process for
+// each job, which dominates the time taken by small ones.
+//
+// All integers are 32-bit big-endian. A job is:
+//   the number of arguments, then the length and bytes of each argument
+//   the number of buffers, then the length and bytes of each buffer
+// The arguments are a command line, without the program name, and the buffers
+// are images which are named @0, @1, ... in place of input files.
+//
+// The response is the output of the job as chunks, each the length and bytes of
+// the chunk, then a zero length and the exit code of the job. Error messages go
+// to the daemon's stderr.
+//
+// Jobs can't use the options which write files (-b, -O, -S, and -p without
+// --pdf-output -): everything a job produces is in the response. A connection
+// which makes no progress for job_timeout seconds is dropped.
+// -----------------------------------------------------------------------------
+
+// the limits on jobs, to bound the memory that a bad client can make us use
+static const uint32_t max_job_args = 4096;
+static const uint32_t max_job_arg_length = 65536;
+static const uint32_t max_job_buffers = 4096;
+static const uint32_t max_job_bytes = 1u << 30;  // arguments and buffers
+static const int job_timeout = 60;
+
+static bool
+read_all(int fd, void *data, size_t length) {
+  uint8_t *p = (uint8_t *) data;
+  while (length) {
+    const ssize_t n = read(fd, p, length);
+    if (n <= 0) return false;
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+static bool
+read_u32(int fd, uint32_t *value) {
+  uint8_t bytes[4];
+  if (!read_all(fd, bytes, sizeof(bytes))) return false;
+  *value = ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) |
+           ((uint32_t) bytes[2] << 8) | bytes[3];
+  return true;
+}
+
+static bool
+write_u32(int fd, uint32_t value) {
+  const uint8_t bytes[4] = {(uint8_t) (value >> 24), (uint8_t) (value >> 16),
+                            (uint8_t) (value >> 8), (uint8_t) value};
+  return write_all(fd, bytes, sizeof(bytes));
+}
+
+// -----------------------------------------------------------------------------
+// Read a list of strings: the number of strings, then each one. The lengths of
+// the strings are taken from *budget, which mustn't run out.
+// -----------------------------------------------------------------------------
+static bool
+read_strings(int fd, uint32_t max_count, uint32_t max_length,
+             uint32_t *budget, std::vector<std::string> *strings) {
+  uint32_t count;
+  if (!read_u32(fd, &count) || count > max_count) return false;
+  strings->resize(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t length;
+    if (!read_u32(fd, &length) || length > max_length || length > *budget) {
+      return false;
     }
-    free(ret);
+    *budget -= length;
+    (*strings)[i].resize(length);
+    if (length && !read_all(fd, &(*strings)[i][0], length)) return false;
   }
+  return true;
+}
 
-  jbig2_destroy(ctx);
-  return 0;
+// -----------------------------------------------------------------------------
+// Read a job from the connection fd, run it and send back the output. fd is
+// closed.
+// -----------------------------------------------------------------------------
+static void
+handle_job(int fd) {
+  struct timeval timeout;
+  timeout.tv_sec = job_timeout;
+  timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  std::vector<std::string> args, buffers;
+  uint32_t budget = max_job_bytes;
+  if (!read_strings(fd, max_job_args, max_job_arg_length, &budget, &args) ||
+      !read_strings(fd, max_job_buffers, max_job_bytes, &budget, &buffers)) {
+    fprintf(stderr, "Invalid job\n");
+    close(fd);
+    return;
+  }
+
+  std::vector<char *> argv;
+  argv.push_back((char *) "jbig2");
+  for (size_t i = 0; i < args.size(); ++i) argv.push_back(&args[i][0]);
+  argv.push_back(NULL);
+
+  struct output out;
+  memset(&out, 0, sizeof(out));
+  out.fd = fd;
+  out.framed = true;
+  const int status = run(argv.size() - 1, argv.data(), &out, &buffers);
+  if (!out.failed) {
+    write_u32(fd, 0);
+    write_u32(fd, status);
+  }
+  close(fd);
+}
+
+// -----------------------------------------------------------------------------
+// Connections waiting for a worker
+// -----------------------------------------------------------------------------
+struct job_queue {
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<int> connections;
+};
+
+static void
+worker(struct job_queue *queue) {
+  for (;;) {
+    int fd;
+    {
+      std::unique_lock<std::mutex> lock(queue->mutex);
+      queue->ready.wait(lock, [queue] { return !queue->connections.empty(); });
+      fd = queue->connections.front();
+      queue->connections.pop_front();
+    }
+    handle_job(fd);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Listen on the Unix domain socket at path and run jobs on workers threads.
+// Only returns on error. A stale socket at path is replaced, but nothing else.
+// -----------------------------------------------------------------------------
+static int
+run_daemon(const char *path, int workers, bool verbose) {
+  // a client which goes away shouldn't take the daemon with it
+  signal(SIGPIPE, SIG_IGN);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    perror("socket");
+    return 1;
+  }
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+  if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) ||
+      listen(listener, 64)) {
+    fprintf(stderr, "Unable to listen on \"%s\": %s\n", path, strerror(errno));
+    close(listener);
+    return 1;
+  }
+  if (verbose) fprintf(stderr, "Listening on \"%s\"\n", path);
+
+  struct job_queue queue;
+  std::vector<std::thread> pool;
+  for (int i = 0; i < workers; ++i) pool.push_back(std::thread(worker, &queue));
+
+  for (;;) {
+    const int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+          errno == ENOMEM) {
+        // wait for the jobs in flight to release some resources
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        continue;
+      }
+      perror("accept");
+      close(listener);
+      // the workers never return
+      for (size_t i = 0; i < pool.size(); ++i) pool[i].detach();
+      return 1;
+    }
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.connections.push_back(fd);
+    queue.ready.notify_one();
+  }
+}
+#endif
+
+int
+main(int argc, char **argv) {
+  if (argc >= 2 && strcmp(argv[1], "--daemon") == 0) {
+#ifndef _WIN32
+    if (argc < 3) {
+      usage(argv[0]);
+      return 1;
+    }
+    int workers = 1;
+    bool verbose = false;
+    for (int i = 3; i < argc; ++i) {
+      if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+        char *endptr;
+        long t_workers = strtol(argv[i+1], &endptr, 10);
+        if (*endptr) {
+          fprintf(stderr, "Cannot parse int value: %s\n", argv[i+1]);
+          usage(argv[0]);
+          return 1;
+        }
+        if (t_workers <= 0 || t_workers > 1024) {
+          fprintf(stderr, "Invalid number of threads: (1..1024)\n");
+          return 13;
+        }
+        workers = (int)t_workers;
+        i++;
+      } else if (strcmp(argv[i], "-v") == 0) {
+        verbose = true;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    return run_daemon(argv[2], workers, verbose);
+#else
+    fprintf(stderr, "--daemon is not supported on this platform\n");
+    return 1;
+#endif
+  }
 
+  struct output out;
+  memset(&out, 0, sizeof(out));
+  out.fd = 1;
+  return run(argc, argv, &out, NULL);
 }
@@ -124,7 +124,77 @@ struct context ctbl[] = {
 
 // see comments in .h file
 void
-jbig2enc_init(struct jbig2enc_ctx *ctx) {
+jbig2enc_arena_init(struct jbig2enc_arena *arena) {
+  arena->blocks = new std::vector<uint8_t *>;
+  arena->block_sizes = new std::vector<size_t>;
+  arena->current = 0;
+  arena->used = 0;
+}
+
+// see comments in .h file
+void *
+jbig2enc_arena_alloc(struct jbig2enc_arena *arena, size_t n) {
+  n = (n + 7) & ~(size_t) 7;
+
+  std::vector<uint8_t *> &blocks = *arena->blocks;
+  std::vector<size_t> &sizes = *arena->block_sizes;
+  if (arena->current < blocks.size() &&
+      arena->used + n <= sizes[arena->current]) {
+    void *const ret = blocks[arena->current] + arena->used;
+    arena->used += n;
+    return ret;
+  }
+
+  // Move on to the next block. If it's missing or too small, a new block is
+  // put in its place (an oversized allocation gets a block of its own).
+  if (arena->current < blocks.size()) arena->current++;
+  if (arena->current == blocks.size() || sizes[arena->current] < n) {
+    const size_t size = n > JBIG2_ARENA_BLOCK_SIZE ? n : JBIG2_ARENA_BLOCK_SIZE;
+    blocks.insert(blocks.begin() + arena->current, (u8 *) malloc(size));
+    sizes.insert(sizes.begin() + arena->current, size);
+  }
+  arena->used = n;
+  return blocks[arena->current];
+}
+
+// see comments in .h file
+void
+jbig2enc_arena_reset(struct jbig2enc_arena *arena) {
+  arena->current = 0;
+  arena->used = 0;
+}
+
+// see comments in .h file
+void
+jbig2enc_arena_dealloc(struct jbig2enc_arena *arena) {
+  for (std::vector<uint8_t *>::iterator i = arena->blocks->begin();
+       i != arena->blocks->end(); ++i) {
+    free(*i);
+  }
+  delete arena->blocks;
+  delete arena->block_sizes;
+}
+
+// -----------------------------------------------------------------------------
+// Allocate memory for a context, from its arena if it has one
+// -----------------------------------------------------------------------------
+static u8 *
+ctx_alloc(struct jbig2enc_ctx *ctx, size_t n) {
+  if (ctx->arena) return (u8 *) jbig2enc_arena_alloc(ctx->arena, n);
+  return (u8 *) malloc(n);
+}
+
+// -----------------------------------------------------------------------------
+// Free memory from ctx_alloc. Memory from an arena is released with the arena.
+// -----------------------------------------------------------------------------
+static void
+ctx_free(struct jbig2enc_ctx *ctx, void *p) {
+  if (!ctx->arena) free(p);
+}
+
+// see comments in .h file
+void
+jbig2enc_init_arena(struct jbig2enc_ctx *ctx, struct jbig2enc_arena *arena) {
   memset(ctx->context, 0, JBIG2_MAX_CTX);
   memset(ctx->intctx, 0, 13 * 512);
   ctx->a = 0x8000;
@@ -132,12 +202,19 @@ jbig2enc_init(struct jbig2enc_ctx *ctx) {
   ctx->ct = 12;
   ctx->bp = -1;
   ctx->b = 0;
+  ctx->arena = arena;
   ctx->outbuf_used = 0;
-  ctx->outbuf = (u8 *) malloc(JBIG2_OUTPUTBUFFER_SIZE);
+  ctx->outbuf = ctx_alloc(ctx, JBIG2_OUTPUTBUFFER_SIZE);
   ctx->output_chunks = new std::vector<uint8_t *>;
   ctx->iaidctx = NULL;
 }
 
+// see comments in .h file
+void
+jbig2enc_init(struct jbig2enc_ctx *ctx) {
+  jbig2enc_init_arena(ctx, NULL);
+}
+
 // see comments in .h file
 void
 jbig2enc_reset(struct jbig2enc_ctx *ctx) {
@@ -146,7 +223,7 @@ jbig2enc_reset(struct jbig2enc_ctx *ctx) {
   ctx->ct = 12;
   ctx->bp = -1;
   ctx->b = 0;
-  free(ctx->iaidctx);
+  ctx_free(ctx, ctx->iaidctx);
   ctx->iaidctx = NULL;
   memset(ctx->context, 0, JBIG2_MAX_CTX);
   memset(ctx->intctx, 0, 13 * 512);
@@ -159,7 +236,7 @@ jbig2enc_flush(struct jbig2enc_ctx *ctx) {
 
   for (std::vector<uint8_t *>::iterator i = ctx->output_chunks->begin();
        i != ctx->output_chunks->end(); ++i) {
-    free(*i);
+    ctx_free(ctx, *i);
   }
   ctx->output_chunks->clear();
   ctx->bp = -1;
@@ -170,11 +247,11 @@ void
 jbig2enc_dealloc(struct jbig2enc_ctx *ctx) {
   for (std::vector<uint8_t *>::iterator i = ctx->output_chunks->begin();
        i != ctx->output_chunks->end(); ++i) {
-    free(*i);
+    ctx_free(ctx, *i);
   }
   delete ctx->output_chunks;
-  free(ctx->outbuf);
-  free(ctx->iaidctx);
+  ctx_free(ctx, ctx->outbuf);
+  ctx_free(ctx, ctx->iaidctx);
 }
 
 // -----------------------------------------------------------------------------
@@ -185,7 +262,7 @@ static void inline
 emit(struct jbig2enc_ctx *restrict ctx) {
   if (unlikely(ctx->outbuf_used == JBIG2_OUTPUTBUFFER_SIZE)) {
     ctx->output_chunks->push_back(ctx->outbuf);
-    ctx->outbuf = (u8 *) malloc(JBIG2_OUTPUTBUFFER_SIZE);
+    ctx->outbuf = ctx_alloc(ctx, JBIG2_OUTPUTBUFFER_SIZE);
     ctx->outbuf_used = 0;
   }
 
@@ -427,7 +504,7 @@ void
 jbig2enc_iaid(struct jbig2enc_ctx *restrict ctx, int symcodelen, int value) {
   if (!ctx->iaidctx) {
     // we've not yet allocated the context index buffer for this
-    ctx->iaidctx = (u8 *) malloc(1 << symcodelen);
+    ctx->iaidctx = ctx_alloc(ctx, 1 << symcodelen);
     memset(ctx->iaidctx, 0, 1 << symcodelen);
   }
   const u32 mask = (1 << (symcodelen + 1)) - 1;
@@ -483,20 +560,94 @@ jbig2enc_tobuffer(const struct jbig2enc_ctx *restrict ctx, u8 *restrict buffer)
 #define TPGDCTX 0x9b25
 
 // -----------------------------------------------------------------------------
-// This is designed for Leptonica's 1bpp packed format images. Each row is some
-// number of 32-bit words. Pixels are in native-byte-order in each word.
+// The rows of a Leptonica image, whose pad bits are zero, so that its words can
+// be used as they are
 // -----------------------------------------------------------------------------
-void
-jbig2enc_bitimage(struct jbig2enc_ctx *restrict ctx, const u8 *restrict idata,
-                  int mx, int my, bool duplicate_line_removal) {
-  const u32 *restrict data = (u32 *) idata;
+struct packed_rows {
+  const u32 *restrict data;
+  int wpl;
+
+  u32 word(int y, int k) const {
+    return data[(size_t) y * wpl + k];
+  }
+};
+
+// -----------------------------------------------------------------------------
+// Returns pixels 32*k to 32*k + 31 of a row of bytes (see jbig2enc_rawimage),
+// the first in the top bit and those past mx zero. The bytes are put in order, and their bits reversed if need
+// be, as the word is fetched.
+// -----------------------------------------------------------------------------
+static inline u32
+raw_word(const u8 *restrict row, int mx, int k, bool lsb_first) {
+  row += 4 * k;
+  const int nbytes = (mx - 32 * k + 7) / 8;
+  u32 w;
+  if (nbytes >= 4) {
+    w = ((u32) row[0] << 24) | ((u32) row[1] << 16) | ((u32) row[2] << 8) |
+        row[3];
+  } else {
+    // don't read past the end of the row, which may be the end of the image
+    w = 0;
+    for (int i = 0; i < nbytes; ++i) w |= (u32) row[i] << (24 - 8 * i);
+  }
+  if (lsb_first) {
+    w = ((w & 0xf0f0f0f0u) >> 4) | ((w & 0x0f0f0f0fu) << 4);
+    w = ((w & 0xccccccccu) >> 2) | ((w & 0x33333333u) << 2);
+    w = ((w & 0xaaaaaaaau) >> 1) | ((w & 0x55555555u) << 1);
+  }
+  if (mx - 32 * k < 32) w &= ~(0xffffffffu >> (mx - 32 * k));
+  return w;
+}
+
+// -----------------------------------------------------------------------------
+// The rows of a caller's image, which are bytes rather than native words
+// -----------------------------------------------------------------------------
+struct raw_rows {
+  const u8 *restrict data;
+  size_t stride;
+  int mx;
+  bool lsb_first;
+
+  u32 word(int y, int k) const {
+    return raw_word(data + y * stride, mx, k, lsb_first);
+  }
+};
+
+// -----------------------------------------------------------------------------
+// Row y of a caller's image and the two before it, which are all that coding
+// row y needs (see jbig2enc_rawimage_row)
+// -----------------------------------------------------------------------------
+struct raw_window {
+  const u8 *rows[3];  // rows y - 2, y - 1 and y
+  int y;
+  int mx;
+  bool lsb_first;
+
+  u32 word(int row, int k) const {
+    return raw_word(rows[2 - (y - row)], mx, k, lsb_first);
+  }
+};
+
+// -----------------------------------------------------------------------------
+// Encode rows y0 to y1 - 1 of a generic region mx pixels wide. rows.word(y, k)
+// returns pixels 32*k to 32*k + 31 of row y, the first in the top bit, with
+// those past mx zero. Only rows y0 - 2 to y1 - 1 are fetched.
+//
+// ltp: the TPGD state, which is 0 before the first row
+// -----------------------------------------------------------------------------
+template <class Rows>
+static void
+encode_generic_rows(struct jbig2enc_ctx *restrict ctx, const Rows &rows,
+                    int mx, int y0, int y1, bool duplicate_line_removal,
+                    u8 *ltp_state) {
   u8 *const context = ctx->context;
   const unsigned words_per_row = (mx + 31) / 32;
-  const unsigned bytes_per_row = words_per_row * 4;
 
-  u8 ltp = 0, sltp = 0;
+#define WORD(y, k) rows.word(y, k)
 
-  for (int y = 0; y < my; ++y) {
+  u8 ltp = *ltp_state, sltp = 0;
+
+  for (int y = y0; y < y1; ++y) {
     int x = 0;
 
     // the c* values store the context bits for each row. The template is fixed
@@ -508,14 +659,17 @@ jbig2enc_bitimage(struct jbig2enc_ctx *restrict ctx, const u8 *restrict idata,
     u32 w1, w2, w3;
     w1 = w2 = w3 = 0;
 
-    if (y >= 2) w1 = data[(y - 2) * words_per_row];
+    if (y >= 2) w1 = WORD(y - 2, 0);
     if (y >= 1) {
-      w2 = data[(y - 1) * words_per_row];
+      w2 = WORD(y - 1, 0);
 
       if (duplicate_line_removal) {
         // it's possible that the last row was the same as this row
-        if (memcmp(&data[y * words_per_row], &data[(y - 1) * words_per_row],
-                   bytes_per_row) == 0) {
+        bool same = true;
+        for (unsigned k = 0; k < words_per_row && same; ++k) {
+          same = WORD(y, k) == WORD(y - 1, k);
+        }
+        if (same) {
           sltp = ltp ^ 1;
           ltp = 1;
         } else {
@@ -528,7 +682,7 @@ jbig2enc_bitimage(struct jbig2enc_ctx *restrict ctx, const u8 *restrict idata,
       encode_bit(ctx, context, TPGDCTX, sltp);
       if (ltp) continue;
     }
-    w3 = data[y * words_per_row];
+    w3 = WORD(y, 0);
 
     // the top three bits are the start of the context c1
     c1 = w1 >> 29;
@@ -556,7 +710,7 @@ jbig2enc_bitimage(struct jbig2enc_ctx *restrict ctx, const u8 *restrict idata,
         if (wordno >= words_per_row) {
           w1 = 0;
         } else {
-          w1 = data[(y - 2) * words_per_row + wordno];
+          w1 = WORD(y - 2, wordno);
         }
       } else {
         w1 <<= 1;
@@ -568,7 +722,7 @@ jbig2enc_bitimage(struct jbig2enc_ctx *restrict ctx, const u8 *restrict idata,
         if (wordno >= words_per_row) {
           w2 = 0;
         } else {
-          w2 = data[(y - 1) * words_per_row + wordno];
+          w2 = WORD(y - 1, wordno);
         }
       } else {
         w2 <<= 1;
@@ -580,7 +734,7 @@ jbig2enc_bitimage(struct jbig2enc_ctx *restrict ctx, const u8 *restrict idata,
         if (wordno >= words_per_row) {
           w3 = 0;
         } else {
-          w3 = data[y * words_per_row + wordno];
+          w3 = WORD(y, wordno);
         }
       } else {
         w3 <<= 1;
@@ -591,6 +745,65 @@ jbig2enc_bitimage(struct jbig2enc_ctx *restrict ctx, const u8 *restrict idata,
       c3 &= 15;
     }
   }
+  *ltp_state = ltp;
+
+#undef WORD
+}
+
+// -----------------------------------------------------------------------------
+// This is designed for Leptonica's 1bpp packed format images. Each row is some
+// number of 32-bit words. Pixels are in native-byte-order in each word.
+// -----------------------------------------------------------------------------
+void
+jbig2enc_bitimage(struct jbig2enc_ctx *restrict ctx, const u8 *restrict idata,
+                  int mx, int my, bool duplicate_line_removal) {
+  struct packed_rows rows;
+  rows.data = (const u32 *) idata;
+  rows.wpl = (mx + 31) / 32;
+  u8 ltp = 0;
+  encode_generic_rows(ctx, rows, mx, 0, my, duplicate_line_removal, &ltp);
+}
+
+void
+jbig2enc_rawimage(struct jbig2enc_ctx *restrict ctx, const u8 *restrict data,
+                  int stride, int mx, int my, bool lsb_first,
+                  bool duplicate_line_removal) {
+  struct raw_rows rows;
+  rows.data = data;
+  rows.stride = stride;
+  rows.mx = mx;
+  rows.lsb_first = lsb_first;
+  u8 ltp = 0;
+  encode_generic_rows(ctx, rows, mx, 0, my, duplicate_line_removal, &ltp);
+}
+
+void
+jbig2enc_rawimage_row(struct jbig2enc_ctx *restrict ctx, const u8 *row2,
+                      const u8 *row1, const u8 *row, int mx, int y,
+                      bool lsb_first, bool duplicate_line_removal, u8 *ltp) {
+  struct raw_window rows;
+  rows.rows[0] = row2;
+  rows.rows[1] = row1;
+  rows.rows[2] = row;
+  rows.y = y;
+  rows.mx = mx;
+  rows.lsb_first = lsb_first;
+  encode_generic_rows(ctx, rows, mx, y, y + 1, duplicate_line_removal, ltp);
+}
+
+// see comments in .h file
+bool
+jbig2enc_drain(struct jbig2enc_ctx *ctx,
+               bool (*sink)(void *arg, const uint8_t *data, size_t length),
+               void *arg) {
+  bool ok = true;
+  for (std::vector<uint8_t *>::iterator i = ctx->output_chunks->begin();
+       i != ctx->output_chunks->end(); ++i) {
+    if (ok) ok = sink(arg, *i, JBIG2_OUTPUTBUFFER_SIZE);
+    ctx_free(ctx, *i);
+  }
+  ctx->output_chunks->clear();
+  return ok;
 }
 
 void
@@ -24,6 +24,8 @@
 #include <stdint.h>
 #endif
 
+#include <stddef.h>
+
 #include <vector>
 
 #define JBIG2_MAX_CTX 65536
@@ -38,6 +40,45 @@
 //#define SYM_DEBUGGING
 //#define SYMBOL_COMPRESSION_DEBUGGING
 
+// -----------------------------------------------------------------------------
+// A bump allocator for the temporary memory used while encoding a page or a
+// symbol dictionary. Allocations are carved out of large blocks and are never
+// freed individually. Instead, jbig2enc_arena_reset releases all of them at
+// once and keeps the blocks for the next page, so a long running encoder
+// settles into a fixed set of blocks rather than fragmenting the heap.
+//
+// An arena must only be used by one thread at a time.
+// -----------------------------------------------------------------------------
+struct jbig2enc_arena {
+  std::vector<uint8_t *> *blocks;  // the blocks, in the order they are used
+  std::vector<size_t> *block_sizes;
+  unsigned current;  // index of the block being allocated from
+  size_t used;  // number of bytes used in the current block
+};
+
+#define JBIG2_ARENA_BLOCK_SIZE (256 * 1024)
+
+// -----------------------------------------------------------------------------
+// Init a new, empty, arena
+// -----------------------------------------------------------------------------
+void jbig2enc_arena_init(struct jbig2enc_arena *arena);
+
+// -----------------------------------------------------------------------------
+// Allocate n bytes, 8-byte aligned
+// -----------------------------------------------------------------------------
+void *jbig2enc_arena_alloc(struct jbig2enc_arena *arena, size_t n);
+
+// -----------------------------------------------------------------------------
+// Release everything which has been allocated from the arena, keeping the
+// memory for reuse
+// -----------------------------------------------------------------------------
+void jbig2enc_arena_reset(struct jbig2enc_arena *arena);
+
+// -----------------------------------------------------------------------------
+// Destroy an arena and free its memory
+// -----------------------------------------------------------------------------
+void jbig2enc_arena_dealloc(struct jbig2enc_arena *arena);
+
 // -----------------------------------------------------------------------------
 // This is the context for the arithmetic encoder used in JBIG2. The coder is a
 // state machine and there are many different states used - one for coding
@@ -61,6 +102,9 @@ struct jbig2enc_ctx {
   uint8_t intctx[13][512];  // 512 bytes of context indexes for each of 13 different int decodings
                             // this data is also used for refinement coding
   uint8_t *iaidctx;  // size of this context not known at construction time
+  // if not NULL, the output chunks and iaidctx are allocated from here (see
+  // jbig2enc_init_arena)
+  struct jbig2enc_arena *arena;
 };
 
 // these are the proc numbers for encoding different classes of integers
@@ -140,6 +184,43 @@ void jbig2enc_bitimage(struct jbig2enc_ctx *__restrict__ ctx,
                        const uint8_t *__restrict__ data, int mx, int my,
                        bool duplicate_line_removal);
 
+// -----------------------------------------------------------------------------
+// Like _bitimage, but for packed rows of bytes rather than of native-endian
+// 32-bit words, so that a caller's image needn't be copied into a Pix. Rows
+// are stride bytes apart and the bits past mx in the last byte of each row may
+// be anything.
+//
+// lsb_first: if true, the first pixel of each byte is its lowest bit rather
+//            than its highest
+// -----------------------------------------------------------------------------
+void jbig2enc_rawimage(struct jbig2enc_ctx *__restrict__ ctx,
+                       const uint8_t *__restrict__ data, int stride, int mx,
+                       int my, bool lsb_first, bool duplicate_line_removal);
+
+// -----------------------------------------------------------------------------
+// Encode row y of an image given as rows of bytes (see _rawimage), so that an
+// image can be encoded as its rows arrive. Call this for y = 0, 1, ... in turn.
+//
+// row2, row1: rows y - 2 and y - 1 (ignored for the first rows)
+// ltp: the TPGD state, which must be 0 before row 0 and is kept by the caller
+//      between rows
+// -----------------------------------------------------------------------------
+void jbig2enc_rawimage_row(struct jbig2enc_ctx *__restrict__ ctx,
+                           const uint8_t *row2, const uint8_t *row1,
+                           const uint8_t *row, int mx, int y, bool lsb_first,
+                           bool duplicate_line_removal, uint8_t *ltp);
+
+// -----------------------------------------------------------------------------
+// Pass the output chunks which are full to sink, in order, and free them. The
+// bytes of the current chunk are kept. After this, _datasize and _tobuffer
+// only cover the output which hasn't been drained.
+//
+// Returns false if sink does. The chunks are freed anyway.
+// -----------------------------------------------------------------------------
+bool jbig2enc_drain(struct jbig2enc_ctx *ctx,
+                    bool (*sink)(void *arg, const uint8_t *data, size_t length),
+                    void *arg);
+
 
 // -----------------------------------------------------------------------------
 // Encode the refinement of an exemplar to a bitmap.
@@ -168,6 +249,13 @@ void jbig2enc_refine(struct jbig2enc_ctx *__restrict__ ctx,
 // -----------------------------------------------------------------------------
 void jbig2enc_init(struct jbig2enc_ctx *ctx);
 
+// -----------------------------------------------------------------------------
+// Init a new context which allocates its memory from arena. The output of the
+// context is only valid until the arena is reset.
+// -----------------------------------------------------------------------------
+void jbig2enc_init_arena(struct jbig2enc_ctx *ctx,
+                         struct jbig2enc_arena *arena);
+
 // -----------------------------------------------------------------------------
 // Destroy a context
 // -----------------------------------------------------------------------------
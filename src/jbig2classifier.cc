@@ -0,0 +1,562 @@
+// Copyright 2026 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <leptonica/allheaders.h>
+#if (LIBLEPT_MAJOR_VERSION == 1 && LIBLEPT_MINOR_VERSION >= 83) || LIBLEPT_MAJOR_VERSION > 1
+#include "leptonica/pix_internal.h"
+#include "leptonica/array_internal.h"
+#endif
+
+#include <math.h>
+#if defined(sun)
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#define u64 uint64_t
+#define u32 uint32_t
+#define u16 uint16_t
+#define u8  uint8_t
+
+#include "jbig2classifier.h"
+#include "jbig2sym.h"
+
+// Components are only compared against templates whose size differs by at most
+// two pixels in each direction. These are the differences in width and height,
+// in the order in which Leptonica's classifier tries them (TWO_BY_TWO_WALK in
+// jbclass.c), so that a component which matches more than one template is
+// given the same one.
+static const int kSizeWalk[25][2] = {
+  {0, 0}, {0, 1}, {-1, 0}, {0, -1}, {1, 0}, {-1, 1}, {1, 1}, {-1, -1},
+  {1, -1}, {0, -2}, {2, 0}, {0, 2}, {-2, 0}, {-1, -2}, {1, -2}, {2, -1},
+  {2, 1}, {1, 2}, {-1, 2}, {-2, 1}, {-2, -1}, {-2, -2}, {2, -2}, {2, 2},
+  {-2, 2},
+};
+
+// -----------------------------------------------------------------------------
+// Rounds to the nearest integer, halves away from zero, as Leptonica does when
+// aligning centroids
+// -----------------------------------------------------------------------------
+static inline int
+round_half_away(float v) {
+  return v >= 0 ? (int) (v + 0.5) : (int) (v - 0.5);
+}
+
+// -----------------------------------------------------------------------------
+// Returns the number of set bits in v
+// -----------------------------------------------------------------------------
+static inline int
+popcount64(u64 v) {
+#if defined(__GNUC__)
+  return __builtin_popcountll(v);
+#else
+  v = v - ((v >> 1) & 0x5555555555555555ull);
+  v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+  v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0full;
+  return (int) ((v * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Returns the number of 64-bit words in a packed row of w pixels
+// -----------------------------------------------------------------------------
+static inline int
+words_per_row(int w) {
+  return (w + 63) / 64;
+}
+
+// -----------------------------------------------------------------------------
+// Returns the 64 pixels of a packed row starting at pixel x, which may be
+// negative or past the end of the row. Pixels outside the row are zero.
+// -----------------------------------------------------------------------------
+static inline u64
+row_bits_at(const u64 *row, int nwords, int x) {
+  const int q = x >= 0 ? x / 64 : -((63 - x) / 64);
+  const int r = x - q * 64;
+  const u64 hi = (q >= 0 && q < nwords) ? row[q] : 0;
+  if (!r) return hi;
+  const u64 lo = (q + 1 >= 0 && q + 1 < nwords) ? row[q + 1] : 0;
+  return (hi << r) | (lo >> (64 - r));
+}
+
+// -----------------------------------------------------------------------------
+// For each possible byte, the sum of the positions of its set bits, counting
+// from the MSB. Used for computing centroids a byte at a time.
+// -----------------------------------------------------------------------------
+struct BitPositionTable {
+  int sum[256];
+
+  BitPositionTable() {
+    for (int b = 0; b < 256; ++b) {
+      sum[b] = 0;
+      for (int bit = 0; bit < 8; ++bit) {
+        if (b & (0x80 >> bit)) sum[b] += bit;
+      }
+    }
+  }
+};
+
+// -----------------------------------------------------------------------------
+// Returns the sum of the x positions of the set pixels in a packed word, where
+// base is the position of the MSB.
+// -----------------------------------------------------------------------------
+static inline double
+word_xsum(u64 word, int base) {
+  static const BitPositionTable table;
+  double xsum = 0;
+  for (int byte = 0; byte < 8 && word; ++byte) {
+    const int b = word >> 56;
+    xsum += table.sum[b] + (double) popcount64(b) * (base + byte * 8);
+    word <<= 8;
+  }
+  return xsum;
+}
+
+jbig2classifier_page::~jbig2classifier_page() {
+  if (pixa) pixaDestroy(&pixa);
+  if (bw) pixDestroy(&bw);
+}
+
+// see comments in .h file
+void
+jbig2classifier_extract(struct jbig2classifier_page *page, PIX *bw) {
+  page->width = pixGetWidth(bw);
+  page->height = pixGetHeight(bw);
+  page->bw = pixClone(bw);
+
+  PIXA *pixa = NULL;
+  BOXA *boxa = pixConnComp(bw, &pixa, 8);
+  boxaDestroy(&boxa);
+  page->pixa = pixa;
+
+  const int n = pixaGetCount(pixa);
+  page->offset.resize(n);
+  page->x.resize(n);
+  page->y.resize(n);
+  page->w.resize(n);
+  page->h.resize(n);
+  page->area.resize(n);
+  page->cx.resize(n);
+  page->cy.resize(n);
+
+  size_t words = 0;
+  for (int i = 0; i < n; ++i) {
+    words += (size_t) words_per_row(pixa->pix[i]->w) * pixa->pix[i]->h;
+  }
+  page->bits.resize(words);
+
+  size_t offset = 0;
+  for (int i = 0; i < n; ++i) {
+    PIX *const pix = pixa->pix[i];
+    const BOX *const box = pixa->boxa->box[i];
+    const int w = pix->w;
+    const int h = pix->h;
+    const int wpl = pix->wpl;
+    const int nwords = words_per_row(w);
+    // mask for the valid bits of the last word of each row
+    const u64 lastmask = (w % 64) ? ~0ull << (64 - (w % 64)) : ~0ull;
+
+    page->offset[i] = offset;
+    page->x[i] = box->x;
+    page->y[i] = box->y;
+    page->w[i] = w;
+    page->h[i] = h;
+
+    int area = 0;
+    double xsum = 0, ysum = 0;
+    for (int y = 0; y < h; ++y) {
+      const u32 *const src = pix->data + y * wpl;
+      u64 *const dst = &page->bits[offset + (size_t) y * nwords];
+      int rowcount = 0;
+      for (int k = 0; k < nwords; ++k) {
+        u64 word = (u64) src[2 * k] << 32;
+        if (2 * k + 1 < wpl) word |= src[2 * k + 1];
+        if (k == nwords - 1) word &= lastmask;
+        dst[k] = word;
+
+        rowcount += popcount64(word);
+        xsum += word_xsum(word, k * 64);
+      }
+      area += rowcount;
+      ysum += (double) y * rowcount;
+    }
+    offset += (size_t) nwords * h;
+
+    page->area[i] = area;
+    page->cx[i] = area ? xsum / area : 0;
+    page->cy[i] = area ? ysum / area : 0;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Returns true if the correlation score of a component and a template is at
+// least score_thresh, once their centroids are aligned.
+//
+// The score is (number of ON pixels in both)^2 / (area1 * area2), which is the
+// same as Leptonica's pixCorrelationScoreThresholded. This stops as soon as the
+// result is known either way.
+// -----------------------------------------------------------------------------
+static bool
+correlation_passes(const struct jbig2classifier_page *page, int comp,
+                   const struct jbig2classifier *classifier, int templ,
+                   float score_thresh) {
+  const int area1 = page->area[comp];
+  const int area2 = classifier->area[templ];
+  // the number of pixels in common needed to pass
+  const double needed = ceil(sqrt((double) score_thresh * area1 * area2));
+  if (needed > area1 || needed > area2) return false;
+
+  // the template pixel at (x, y) lines up with the component pixel at
+  // (x + dx, y + dy)
+  const int dx = round_half_away(page->cx[comp] - classifier->cx[templ]);
+  const int dy = round_half_away(page->cy[comp] - classifier->cy[templ]);
+
+  const int w1 = page->w[comp], h1 = page->h[comp];
+  const int w2 = classifier->w[templ], h2 = classifier->h[templ];
+  const int nwords1 = words_per_row(w1);
+  const int nwords2 = words_per_row(w2);
+  const u64 *const bits1 = &page->bits[page->offset[comp]];
+  const u64 *const bits2 = &classifier->bits[classifier->offset[templ]];
+
+  const int ystart = dy > 0 ? dy : 0;
+  const int yend = h2 + dy < h1 ? h2 + dy : h1;
+
+  int count = 0;
+  // the component pixels which have not been looked at yet, an upper bound on
+  // how many more pixels can be in common
+  int remaining = area1;
+  for (int y = 0; y < h1; ++y) {
+    const u64 *const row1 = bits1 + (size_t) y * nwords1;
+    if (y < ystart || y >= yend) {
+      for (int k = 0; k < nwords1; ++k) remaining -= popcount64(row1[k]);
+    } else {
+      const u64 *const row2 = bits2 + (size_t) (y - dy) * nwords2;
+      for (int k = 0; k < nwords1; ++k) {
+        remaining -= popcount64(row1[k]);
+        count += popcount64(row1[k] & row_bits_at(row2, nwords2, k * 64 - dx));
+      }
+    }
+    if (count >= needed) return true;
+    if (count + remaining < needed) return false;
+  }
+
+  return count >= needed;
+}
+
+// -----------------------------------------------------------------------------
+// Returns a mask of the pixels x .. x + 63 which are in [lo, hi)
+// -----------------------------------------------------------------------------
+static inline u64
+range_mask(int x, int lo, int hi) {
+  const int start = lo > x ? lo - x : 0;
+  const int end = hi - x < 64 ? hi - x : 64;
+  if (start >= end) return 0;
+  return (~0ull >> start) & (end == 64 ? ~0ull : ~(~0ull >> end));
+}
+
+// -----------------------------------------------------------------------------
+// Returns the pixels x .. x + 63 of a row of a 1 bpp PIX, as a packed word,
+// with those outside mask clear. The words of the row outside mask aren't
+// read.
+// -----------------------------------------------------------------------------
+static inline u64
+pix_bits_at(const u32 *row, int wpl, int x, u64 mask) {
+  if (!mask) return 0;
+  const int q = x >= 0 ? x / 32 : -((31 - x) / 32);
+  const int r = x - q * 32;
+  u32 words[3];
+  for (int k = 0; k < 3; ++k) {
+    words[k] = (q + k >= 0 && q + k < wpl) ? row[q + k] : 0;
+  }
+  u64 bits = ((u64) words[0] << 32) | words[1];
+  if (r) bits = (bits << r) | (words[2] >> (32 - r));
+  return bits & mask;
+}
+
+// -----------------------------------------------------------------------------
+// Leptonica's final step in placing a template (finalPositionForAlignment in
+// jbclass.c): the template, with its border, is placed at (x, y) and moved by
+// up to a pixel in each direction, and the move which leaves the fewest pixels
+// differing from the page, in the rectangle it covered to start with, is
+// returned in *dx and *dy. Ties go to the first move tried.
+//
+// Like Leptonica, the rectangle is clipped to the page and the template is
+// placed relative to the clipped rectangle, which shifts it at the edges.
+// -----------------------------------------------------------------------------
+static void
+final_alignment(const struct jbig2classifier_page *page,
+                const struct jbig2classifier *classifier, int templ, int x,
+                int y, int *dx, int *dy) {
+  const int w = classifier->w[templ];
+  const int h = classifier->h[templ];
+  const int nwords = words_per_row(w);
+  const u64 *const bits = &classifier->bits[classifier->offset[templ]];
+  const int border = JB_ADDED_PIXELS;
+
+  // the rectangle of the page, clipped
+  const int x0 = x - border > 0 ? x - border : 0;
+  const int y0 = y - border > 0 ? y - border : 0;
+  const int x1 = x + w + border < page->width ? x + w + border : page->width;
+  const int y1 = y + h + border < page->height ? y + h + border : page->height;
+  *dx = *dy = 0;
+  if (x0 >= x1 || y0 >= y1) return;
+
+  const u32 *const data = page->bw->data;
+  const int wpl = page->bw->wpl;
+  // The number of differing pixels is the number of ON pixels of the page in
+  // the rectangle, which is the same for every move, plus the number of ON
+  // pixels of the template in it, less twice the number of those which are ON
+  // in the page too.
+  int best = 0;
+  for (int my = -1; my <= 1; ++my) {
+    for (int mx = -1; mx <= 1; ++mx) {
+      int cost = 0;
+      for (int ty = 0; ty < h; ++ty) {
+        const int py = y0 + border + my + ty;
+        if (py < y0 || py >= y1) continue;
+        const u32 *const row = data + (size_t) py * wpl;
+        const u64 *const trow = bits + (size_t) ty * nwords;
+        for (int k = 0; k < nwords; ++k) {
+          const int px = x0 + border + mx + k * 64;
+          const u64 mask = range_mask(px, x0, x1);
+          const u64 t = trow[k] & mask;
+          if (!t) continue;
+          cost += popcount64(t) - 2 * popcount64(t & pix_bits_at(row, wpl, px, mask));
+        }
+      }
+      if ((mx == -1 && my == -1) || cost < best) {
+        best = cost;
+        *dx = mx;
+        *dy = my;
+      }
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Adds component comp of a page as a new template and returns its number
+// -----------------------------------------------------------------------------
+static int
+add_template(struct jbig2classifier *classifier,
+             const struct jbig2classifier_page *page, int comp) {
+  const int templ = classifier->w.size();
+  const size_t nwords = (size_t) words_per_row(page->w[comp]) * page->h[comp];
+  const size_t offset = classifier->bits.size();
+  classifier->bits.insert(classifier->bits.end(),
+                          page->bits.begin() + page->offset[comp],
+                          page->bits.begin() + page->offset[comp] + nwords);
+  classifier->offset.push_back(offset);
+  classifier->w.push_back(page->w[comp]);
+  classifier->h.push_back(page->h[comp]);
+  classifier->area.push_back(page->area[comp]);
+  classifier->cx.push_back(page->cx[comp]);
+  classifier->cy.push_back(page->cy[comp]);
+  classifier->buckets[((u32) page->w[comp] << 16) | page->h[comp]].push_back(templ);
+  return templ;
+}
+
+// -----------------------------------------------------------------------------
+// Returns the first template which component comp of a page matches, or -1 if
+// there is none.
+// -----------------------------------------------------------------------------
+static int
+find_template(const struct jbig2classifier *classifier,
+              const struct jbig2classifier_page *page, int comp) {
+  const int w = page->w[comp];
+  const int h = page->h[comp];
+  const float thresh = classifier->thresh;
+  const float weight = classifier->weight;
+
+  // The templates of each size are tried in the order they were created.
+  for (int step = 0; step < 25; ++step) {
+    const int tw = w + kSizeWalk[step][0];
+    const int th = h + kSizeWalk[step][1];
+    if (tw <= 0 || th <= 0) continue;
+    std::map<u32, std::vector<int> >::const_iterator it =
+      classifier->buckets.find(((u32) tw << 16) | th);
+    if (it == classifier->buckets.end()) continue;
+
+    for (std::vector<int>::const_iterator t = it->second.begin();
+         t != it->second.end(); ++t) {
+      // Thick templates need a higher threshold since a large number of
+      // pixels in common is easier to achieve.
+      float score_thresh = thresh;
+      if (weight > 0.0) {
+        const float fgfract =
+          (float) classifier->area[*t] / (classifier->w[*t] * classifier->h[*t]);
+        score_thresh = thresh + (1.0 - thresh) * weight * fgfract;
+      }
+      if (correlation_passes(page, comp, classifier, *t, score_thresh)) {
+        return *t;
+      }
+    }
+  }
+
+  return -1;
+}
+
+// see comments in .h file
+void
+jbig2classifier_classify_local(struct jbig2classifier_page *page, float thresh,
+                               float weight) {
+  const int n = page->w.size();
+  struct jbig2classifier local(thresh, weight);
+
+  page->local_class.resize(n);
+  page->local_rep.clear();
+  for (int i = 0; i < n; ++i) {
+    int found = find_template(&local, page, i);
+    if (found < 0) {
+      found = add_template(&local, page, i);
+      page->local_rep.push_back(i);
+    }
+    page->local_class[i] = found;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Returns the template which component comp of a page belongs to, adding it
+// as a new template (to both classifier and classer, or templates) if it
+// matches none.
+// -----------------------------------------------------------------------------
+static int
+classify_component(struct jbig2classifier *classifier,
+                   const struct jbig2classifier_page *page, int comp,
+                   struct JbClasser *classer,
+                   struct jbig2enc_templates *templates) {
+  int found = find_template(classifier, page, comp);
+  if (found < 0) {
+    found = add_template(classifier, page, comp);
+    if (templates) {
+      jbig2enc_templates_add(templates, page->pixa->pix[comp], 0);
+    } else {
+      // the rest of the encoder expects bordered templates, like Leptonica's
+      pixaAddPix(classer->pixat,
+                 pixAddBorder(page->pixa->pix[comp], JB_ADDED_PIXELS, 0),
+                 L_INSERT);
+    }
+    classer->nclass++;
+  }
+  return found;
+}
+
+// see comments in .h file
+void
+jbig2classifier_classify(struct jbig2classifier *classifier,
+                         struct jbig2classifier_page *page,
+                         struct JbClasser *classer,
+                         struct jbig2enc_templates *templates) {
+  const int n = page->w.size();
+
+  // With local classes, only their representatives are matched against the
+  // templates and the other components follow them.
+  std::vector<int> global_class;
+  if (!page->local_class.empty()) {
+    global_class.resize(page->local_rep.size());
+    for (size_t c = 0; c < page->local_rep.size(); ++c) {
+      global_class[c] = classify_component(classifier, page, page->local_rep[c],
+                                           classer, templates);
+    }
+  }
+
+  for (int i = 0; i < n; ++i) {
+    const int found = global_class.empty() ?
+                      classify_component(classifier, page, i, classer,
+                                         templates) :
+                      global_class[page->local_class[i]];
+
+    // place the template so that its centroid lines up with the component
+    // (for a component which became a template, this is where it was), and
+    // then nudge it for the best fit
+    const int x = page->x[i] +
+                  round_half_away(page->cx[i] - classifier->cx[found]);
+    const int y = page->y[i] +
+                  round_half_away(page->cy[i] - classifier->cy[found]);
+    int dx, dy;
+    final_alignment(page, classifier, found, x, y, &dx, &dy);
+
+    numaAddNumber(classer->naclass, found);
+    numaAddNumber(classer->napage, classer->npages);
+    ptaAddPt(classer->ptaul, x + dx, y + dy);
+  }
+
+  if (page->width > classer->w) classer->w = page->width;
+  if (page->height > classer->h) classer->h = page->height;
+  classer->baseindex += n;
+  classer->npages++;
+}
+
+// see comments in .h file
+void
+jbig2classifier_retire(struct jbig2classifier *classifier, int templ) {
+  if (classifier->offset[templ] == (size_t) -1) return;
+
+  std::vector<int> &bucket =
+    classifier->buckets[((u32) classifier->w[templ] << 16) | classifier->h[templ]];
+  bucket.erase(std::find(bucket.begin(), bucket.end(), templ));
+  if (bucket.empty()) {
+    classifier->buckets.erase(((u32) classifier->w[templ] << 16) |
+                              classifier->h[templ]);
+  }
+  classifier->offset[templ] = (size_t) -1;
+  classifier->retired_words +=
+    (size_t) words_per_row(classifier->w[templ]) * classifier->h[templ];
+
+  // Compact the bitmaps of the live templates once at least half of the
+  // words are dead, so that the cost is amortised over the retirements.
+  if (classifier->retired_words * 2 < classifier->bits.size()) return;
+  std::vector<u64> bits;
+  bits.reserve(classifier->bits.size() - classifier->retired_words);
+  for (size_t t = 0; t < classifier->offset.size(); ++t) {
+    if (classifier->offset[t] == (size_t) -1) continue;
+    const size_t nwords = (size_t) words_per_row(classifier->w[t]) * classifier->h[t];
+    const size_t offset = bits.size();
+    bits.insert(bits.end(), classifier->bits.begin() + classifier->offset[t],
+                classifier->bits.begin() + classifier->offset[t] + nwords);
+    classifier->offset[t] = offset;
+  }
+  classifier->bits.swap(bits);
+  classifier->retired_words = 0;
+}
+
+// see comments in .h file
+void
+jbig2classifier_truncate(struct jbig2classifier *classifier, int n) {
+  const int ntemplates = classifier->w.size();
+  if (n >= ntemplates) return;
+
+  // newest first, so each is the last member of its bucket
+  for (int t = ntemplates - 1; t >= n; --t) {
+    const u32 key = ((u32) classifier->w[t] << 16) | classifier->h[t];
+    std::vector<int> &bucket = classifier->buckets[key];
+    bucket.erase(std::find(bucket.begin(), bucket.end(), t));
+    if (bucket.empty()) classifier->buckets.erase(key);
+  }
+  classifier->bits.resize(classifier->offset[n]);
+  classifier->offset.resize(n);
+  classifier->w.resize(n);
+  classifier->h.resize(n);
+  classifier->area.resize(n);
+  classifier->cx.resize(n);
+  classifier->cy.resize(n);
+}
@@ -0,0 +1,164 @@
+// Copyright 2026 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2CLASSIFIER_H__
+#define JBIG2ENC_JBIG2CLASSIFIER_H__
+
+#if defined(sun)
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#include <stddef.h>
+
+#include <map>
+#include <vector>
+
+struct Pix;
+struct Pixa;
+struct JbClasser;
+struct jbig2enc_templates;
+
+// -----------------------------------------------------------------------------
+// This is an in-tree version of Leptonica's correlation classifier
+// (jbCorrelationInit + jbAddPage), which follows it step by step: components
+// are compared against templates whose size is within two pixels of theirs,
+// with the sizes and the templates of each size tried in Leptonica's order,
+// after aligning the centroids, and the first template whose correlation score
+// passes the (weighted) threshold is taken. If none does, the component
+// becomes a new template. Each template is then placed where the centroids line
+// up and moved by up to a pixel for the best fit, like Leptonica's
+// finalPositionForAlignment.
+//
+// jbig2_classifier_check_* in jbig2enc.h compares the two (jbig2
+// --compare-classifiers runs it on a set of pages). The centroids are computed
+// in a different precision, so a component whose centroids are exactly half a
+// pixel apart may, rarely, be aligned differently.
+//
+// Rather than PIX structures, bitmaps are kept packed in one arena per page
+// and one for the templates. Each row is a whole number of 64-bit words with
+// the leftmost pixel in the MSB and the bits past the width clear. That lets
+// the correlation be computed with popcounts over whole words.
+//
+// The results are written into a Leptonica JbClasser (naclass, napage, ptaul,
+// nclass, npages and baseindex) so that the rest of the encoder, which reads
+// those, doesn't care which classifier was used. New templates go either into
+// the classer's pixat, with Leptonica's border, or straight into the encoder's
+// compact store (see jbig2sym.h).
+// -----------------------------------------------------------------------------
+
+// -----------------------------------------------------------------------------
+// The connected components of a page, with everything the classifier needs
+// to know about them.
+// -----------------------------------------------------------------------------
+struct jbig2classifier_page {
+  struct Pixa *pixa;  // the components, as found by pixConnComp
+  struct Pix *bw;  // the page, which placing the templates looks at
+  int width, height;  // size of the page
+  // packed bitmaps of the components, see above
+  std::vector<uint64_t> bits;
+  // and, for each component:
+  std::vector<size_t> offset;  // index of the first word in bits
+  std::vector<int> x, y, w, h;  // the bounding box on the page
+  std::vector<int> area;  // number of ON pixels
+  std::vector<float> cx, cy;  // centroid, relative to the bounding box
+  // only set by jbig2classifier_classify_local: the local class of each
+  // component and, for each local class, its first component
+  std::vector<int> local_class;
+  std::vector<int> local_rep;
+
+  jbig2classifier_page() : pixa(NULL), bw(NULL), width(0), height(0) {}
+  ~jbig2classifier_page();
+};
+
+// -----------------------------------------------------------------------------
+// The set of templates found so far.
+// -----------------------------------------------------------------------------
+struct jbig2classifier {
+  float thresh, weight;  // see jbig2_init
+  // if true, pages are classified locally first, see
+  // jbig2classifier_classify_local
+  bool local_classes;
+  // packed bitmaps of the templates
+  std::vector<uint64_t> bits;
+  // and, for each template:
+  std::vector<size_t> offset;  // (size_t) -1 once the template is retired
+  std::vector<int> w, h, area;
+  std::vector<float> cx, cy;
+  // maps from the size of a template (w << 16 | h) to the templates of that
+  // size, in the order in which they were created. Retired templates are
+  // removed.
+  std::map<uint32_t, std::vector<int> > buckets;
+  // the number of words in bits which belong to retired templates
+  size_t retired_words;
+
+  jbig2classifier(float ithresh, float iweight)
+      : thresh(ithresh), weight(iweight), local_classes(false),
+        retired_words(0) {}
+};
+
+// -----------------------------------------------------------------------------
+// Find the connected components of a 1 bpp page and compute their packed
+// bitmaps, areas and centroids.
+//
+// This doesn't touch any classifier state, so it may be run for several pages
+// at once on different threads.
+// -----------------------------------------------------------------------------
+void jbig2classifier_extract(struct jbig2classifier_page *page, struct Pix *bw);
+
+// -----------------------------------------------------------------------------
+// Classify the components of a page among themselves, using the same rules as
+// jbig2classifier_classify. A page rarely has more than a few hundred distinct
+// shapes, so this is quick, and jbig2classifier_classify then only needs to
+// look up one representative of each local class in the (much larger) set of
+// templates for the whole document.
+//
+// Like jbig2classifier_extract, this only touches the page.
+// -----------------------------------------------------------------------------
+void jbig2classifier_classify_local(struct jbig2classifier_page *page,
+                                    float thresh, float weight);
+
+// -----------------------------------------------------------------------------
+// Classify the components of a page, which must have come from
+// jbig2classifier_extract, and append the results to classer. Pages must be
+// classified in order.
+//
+// If the page has been through jbig2classifier_classify_local, every component
+// is given the template of its local representative.
+//
+// templates: if not NULL, new templates are appended to it rather than to
+//            classer->pixat, which is left alone
+// -----------------------------------------------------------------------------
+void jbig2classifier_classify(struct jbig2classifier *classifier,
+                              struct jbig2classifier_page *page,
+                              struct JbClasser *classer,
+                              struct jbig2enc_templates *templates);
+
+// -----------------------------------------------------------------------------
+// Retire a template: components are no longer compared against it and its
+// bitmap is freed (once enough bitmaps have been retired to make compacting
+// the others worthwhile). The template keeps its number, so components which
+// were classified as it are unaffected.
+// -----------------------------------------------------------------------------
+void jbig2classifier_retire(struct jbig2classifier *classifier, int templ);
+
+// -----------------------------------------------------------------------------
+// Forget every template from number n onwards, as if they had never been
+// created, so that their numbers are used again. None of them may have been
+// retired.
+// -----------------------------------------------------------------------------
+void jbig2classifier_truncate(struct jbig2classifier *classifier, int n);
+
+#endif  // JBIG2ENC_JBIG2CLASSIFIER_H__
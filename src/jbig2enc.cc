@@ -17,10 +17,17 @@
 
 #include <map>
 #include <list>
+#include <deque>
 #include <vector>
 #include <algorithm>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <leptonica/allheaders.h>
@@ -41,11 +48,13 @@
 #define u16 uint16_t
 #define u8  uint8_t
 
+#include "jbig2enc.h"
 #include "jbig2arith.h"
 #include "jbig2sym.h"
 #include "jbig2structs.h"
 #include "jbig2segments.h"
 #include "jbig2comparator.h"
+#include "jbig2classifier.h"
 
 // -----------------------------------------------------------------------------
 // Returns the version identifier as a static string.
@@ -92,33 +101,128 @@ log2up(int v) {
   return r + 1;
 }
 
+// -----------------------------------------------------------------------------
+// A symbol dictionary written in windowed mode (see jbig2_set_window)
+// -----------------------------------------------------------------------------
+struct jbig2_window_dict {
+  int segnum;  // segment number
+  int nsymbols;  // number of symbols exported
+  int live;  // number of those symbols which haven't been retired
+  int first_symbol;  // number of its first symbol in the current window
+};
+
 // -----------------------------------------------------------------------------
 // This is the context for a multi-page JBIG2 document.
 // -----------------------------------------------------------------------------
 struct jbig2ctx {
   struct JbClasser *classer;  // the leptonica classifier
+  // if not NULL, used instead of Leptonica to classify the components (the
+  // results still end up in classer). See jbig2_use_native_classifier
+  struct jbig2classifier *classifier;
   int xres, yres;  // ppi for the X and Y direction
   bool full_headers;  // true if we are producing a full JBIG2 file
   bool pdf_page_numbering;  // true if all text pages are page "1" (pdf mode)
   int segnum;  // current segment number
-  int symtab_segment;  // the segment number of the symbol table
-  // a map from page number a list of components for that page
-  std::map<int, std::vector<int> > pagecomps;
-  // for each page, the list of symbols which are only used on that page
-  std::map<int, std::vector<unsigned> > single_use_symbols;
+  // the segment numbers of the global symbol tables. There is one unless
+  // jbig2_split_global_dictionary was called
+  std::vector<int> symtab_segments;
+  int global_dictionaries;  // see jbig2_split_global_dictionary
+  float decode_weight;  // see jbig2_set_decode_cost_weight
+  int page_clusters;  // see jbig2_set_page_clusters
+  // the cluster of each page (empty if the pages aren't clustered) and, for
+  // each cluster, the number of symbols and the segment number of its
+  // dictionary
+  std::vector<int> page_cluster;
+  std::vector<int> cluster_nsymbols;
+  std::vector<int> cluster_segnum;
+  // when not producing full headers, the coded dictionary of each cluster
+  std::vector<std::vector<uint8_t> > cluster_dicts;
+  // the number of the first segment of each page. The segment numbers of every
+  // page are assigned in jbig2_pages_complete so pages can be produced in any
+  // order
+  std::vector<int> page_segnum;
+  // the components of page p are numbered from page_comps[p] up to (but not
+  // including) page_comps[p + 1]
+  std::vector<int> page_comps;
+  // the symbols in the symbol table of page p (the ones which aren't global)
+  // are single_use_symbols[single_use_start[p]] up to (but not including)
+  // single_use_symbols[single_use_start[p + 1]]
+  std::vector<int> single_use_start;
+  // page_segnum, page_comps and single_use_start are indexed from this page,
+  // which is only non-zero in windowed mode
+  std::vector<unsigned> single_use_symbols;
+  int first_page;
   // the number of symbols in the global symbol table
   int num_global_symbols;
   std::vector<int> page_xres, page_yres;
   std::vector<int> page_width, page_height;
-  // Used to store the mapping from symbol number to the index in the global
-  // symbol dictionary.
-  std::map<int, int> symmap;
+  // Used to store the mapping from symbol number to the symbol number in the
+  // JBIG2 stream: the index in the global symbol dictionary or, for a symbol
+  // in a cluster's or a per-page dictionary, num_global_symbols (plus the size
+  // of the cluster's dictionary, for a per-page one) plus the index in that
+  // dictionary. -1 if the symbol hasn't been encoded (yet).
+  std::vector<int> symmap;
   bool refinement;
   PIXA *avg_templates;  // grayed templates
+  // the templates, once jbig2_pages_complete has run, or as they are created if
+  // store_templates is set. These are what is encoded, and the PIXs in the
+  // classer are freed.
+  struct jbig2enc_templates templates;
+  // if true, the native classifier adds new templates to templates rather than
+  // to the classer's pixat, which stays empty
+  bool store_templates;
+  // arenas for the coders of the pages and the window dictionaries, kept so
+  // that their blocks are reused from one page to the next. Pages may be
+  // produced on several threads at once, so each call takes one of its own.
+  mutable std::mutex arena_mutex;
+  mutable std::vector<struct jbig2enc_arena *> spare_arenas;
   int refine_level;
   // only used when using refinement
     // the number of the first symbol of each page
     std::vector<int> baseindexes;
+  // only used when auto thresholding online (see
+  // jbig2enc_auto_threshold_online)
+    bool online_thresh;
+    bool online_use_hash;
+    // maps every template seen so far to its representant. A template which
+    // is its own representant is kept, the others are retired.
+    std::vector<int> online_representant;
+    // the representants bucketed by the hash of their bits
+    std::map<u64, std::list<int> > online_exact;
+    // the representants bucketed by template_hash_key (or all in bucket 0
+    // when not using the hash)
+    std::map<unsigned int, std::list<int> > online_bins;
+    // retired templates. Their PIXs have been freed, but they keep their
+    // numbers until remove_online_retired.
+    std::list<int> online_retired;
+  // only used when ingesting pages in parallel (see jbig2_set_ingest_threads)
+    int ingest_threads;
+    // pages which have been added but not yet classified, oldest first. Each
+    // is having its components extracted on a worker thread.
+    std::deque<std::future<jbig2classifier_page *> > pending_pages;
+  // only used in windowed mode (see jbig2_set_window)
+    bool windowed;
+    int retire_windows;
+    int window;  // the number of windows written so far
+    int first_template;  // the first template which hasn't been written
+    // for each template: the last window which used it, the dictionary it was
+    // written in and its number in that dictionary
+    std::vector<int> template_last_use;
+    std::vector<int> template_dict;
+    std::vector<int> template_dict_index;
+    // the templates which haven't been retired
+    std::vector<int> live_templates;
+    std::vector<struct jbig2_window_dict> window_dicts;
+    // the dictionaries which still have live templates, in order
+    std::vector<int> live_dicts;
+  // only used when streaming after a sample (see jbig2_stream_after_sample)
+    bool stream_after_sample;
+    // the number of pages, templates, components and single use symbols in the
+    // sample, or -1 if jbig2_pages_complete hasn't been called
+    int sample_pages;
+    int sample_templates;
+    int sample_comps;
+    int sample_single_use;
 };
 
 // see comments in .h file
@@ -131,10 +235,28 @@ jbig2_init(float thresh, float weight, int xres, int yres, bool full_headers,
   ctx->full_headers = full_headers;
   ctx->pdf_page_numbering = !full_headers;
   ctx->segnum = 0;
-  ctx->symtab_segment = -1;
+  ctx->global_dictionaries = 1;
+  ctx->decode_weight = 0;
+  ctx->page_clusters = 1;
   ctx->refinement = refine_level >= 0;
   ctx->refine_level = refine_level;
   ctx->avg_templates = NULL;
+  ctx->classifier = NULL;
+  ctx->store_templates = false;
+
+  ctx->online_thresh = false;
+  ctx->online_use_hash = false;
+  ctx->ingest_threads = 1;
+  ctx->first_page = 0;
+
+  ctx->windowed = false;
+  ctx->retire_windows = 0;
+  ctx->window = 0;
+  ctx->first_template = 0;
+
+  ctx->stream_after_sample = false;
+  ctx->sample_pages = -1;
+  ctx->sample_templates = ctx->sample_comps = ctx->sample_single_use = 0;
 
   ctx->classer = jbCorrelationInitWithoutComponents(JB_CONN_COMPS, 9999, 9999,
                                                     thresh, weight);
@@ -241,12 +363,14 @@ remove_templates(jbig2ctx *ctx, std::list<int> &templates_to_remove) {
   //     reverse.
   // it: represents pointer to actual representant in list which should be
   //     removed.
-  int last = templates_to_remove.back();
   for (int index = (pixat->n - 1); ((it != templates_to_remove.end()) && (index >= (*it))); index--) {
     // check if we assign PIX which should not be removed
-    if (index == last) {
+    if (index == templates_to_remove.back()) {
+      // if it points at the element being popped then every template has been
+      // handled once this one is removed
+      const bool last_one = it == --templates_to_remove.end();
       templates_to_remove.pop_back();
-      last = templates_to_remove.back();
+      if (last_one) it = templates_to_remove.end();
     } else {
       PIX * end_pix;
       PIX * copied_pix;
@@ -349,6 +473,304 @@ unite_templates_with_indexes(struct jbig2ctx *ctx, int firstTemplateIndex,
   return 0;
 }
 
+// -----------------------------------------------------------------------------
+// unite_new_representants unites every list of templates in new_representants
+// into the template it is keyed by and then removes the united templates from
+// the classer in a single pass.
+// -----------------------------------------------------------------------------
+static void
+unite_new_representants(struct jbig2ctx *ctx,
+                        std::map<unsigned int, std::list<int> > &new_representants) {
+  std::list<int> templates_to_remove;
+  std::map<unsigned int, std::list<int> >::iterator it;
+  for (it = new_representants.begin(); it != new_representants.end(); it++) {
+    if (!unite_templates(ctx, it->first, it->second)) {
+      templates_to_remove.merge(it->second);
+    }
+  }
+
+  if (remove_templates(ctx, templates_to_remove)) {
+    fprintf(stderr, "warning: removing united templates wasn't fully successful");
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Returns a 64-bit hash of the pixels of a classer template. Only the rows
+// inside the JB_ADDED_PIXELS border are hashed because the border rows are
+// always clear. The pad bits of pix must be zero.
+// -----------------------------------------------------------------------------
+static u64
+hash_template_bits(PIX *const pix) {
+  const int wpl = pixGetWpl(pix);
+  const u32 *const data = pixGetData(pix);
+  const int h = pixGetHeight(pix);
+
+  // FNV-1a over 32-bit words, seeded with the dimensions
+  u64 hash = 0xcbf29ce484222325ull ^ (((u64) pixGetWidth(pix) << 32) | h);
+  for (int y = JB_ADDED_PIXELS; y < h - JB_ADDED_PIXELS; ++y) {
+    const u32 *const row = data + y * wpl;
+    for (int i = 0; i < wpl; ++i) {
+      hash ^= row[i];
+      hash *= 0x100000001b3ull;
+    }
+  }
+
+  // the multiply only carries bits upwards, so finish with a full avalanche
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// -----------------------------------------------------------------------------
+// unite_exact_duplicates collapses templates which are pixel-for-pixel
+// identical. Leptonica's correlation classifier can split a single glyph into
+// several classes because of small differences in the centroids, even though
+// the templates are the same.
+//
+// This is a single pass over the templates, bucketing them by a hash of their
+// bits. Only templates with the same hash are compared and they are compared
+// exactly, so this is much cheaper than the fuzzy comparisons which follow it.
+// -----------------------------------------------------------------------------
+static void
+unite_exact_duplicates(struct jbig2ctx *ctx) {
+  // maps from a hash to the representants which have that hash
+  std::map<u64, std::list<int> > hashed_templates;
+  // maps from a representant to the list of its duplicates
+  std::map<unsigned int, std::list<int> > new_representants;
+
+  PIXA *pixa = ctx->classer->pixat;
+  for (int i = 0; i < pixaGetCount(pixa); i++) {
+    PIX *pix = pixa->pix[i];
+    pixSetPadBits(pix, 0);
+    std::list<int> &representants = hashed_templates[hash_template_bits(pix)];
+
+    bool found = false;
+    for (std::list<int>::iterator it = representants.begin();
+         it != representants.end(); it++) {
+      l_int32 same = 0;
+      pixEqual(pixa->pix[*it], pix, &same);
+      if (same) {
+        new_representants[*it].push_back(i);
+        found = true;
+        break;
+      }
+    }
+    if (!found) representants.push_back(i);
+  }
+
+#ifdef UNIFICATION_DEBUGGING
+  fprintf(stderr, "exact duplicates: %d templates, %d hash bins\n",
+          pixaGetCount(pixa), (int) hashed_templates.size());
+#endif
+
+  if (!new_representants.empty()) {
+    unite_new_representants(ctx, new_representants);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Returns the key used to bin templates which might be equivalent. It is built
+// from the size of the template and the number of connected components.
+// -----------------------------------------------------------------------------
+static unsigned int
+template_hash_key(PIX *pix) {
+  l_uint32 w = pixGetWidth(pix);
+  l_uint32 h = pixGetHeight(pix);
+
+  // find number of holes.
+  l_int32 holes;
+  pixCountConnComp(pix, 4, &holes);
+
+  return (holes + 10 * h + 10000 * w) % 10000000;
+}
+
+// -----------------------------------------------------------------------------
+// Removes the templates retired by online auto thresholding from the classer.
+//
+// The classer cannot lose templates while pages are still being added since it
+// indexes them internally, so retired templates keep a (tiny) slot in pixat
+// until all the pages are in. Removing them renumbers the templates, so the
+// online state is reset and rebuilt should another page be added.
+// -----------------------------------------------------------------------------
+static void
+remove_online_retired(struct jbig2ctx *ctx) {
+  if (!ctx->online_retired.empty()) {
+    if (remove_templates(ctx, ctx->online_retired)) {
+      fprintf(stderr, "warning: removing retired templates wasn't fully successful");
+    }
+  }
+  ctx->online_retired.clear();
+  ctx->online_representant.clear();
+  ctx->online_exact.clear();
+  ctx->online_bins.clear();
+}
+
+// -----------------------------------------------------------------------------
+// Retires a template which online auto thresholding has found to be equivalent
+// to an earlier one, so that new components are no longer compared against it
+// and its bitmap is freed. Its slot in pixat is taken by a 1x1 placeholder,
+// which no component can match, so that the numbers of the other templates
+// don't change.
+// -----------------------------------------------------------------------------
+static void
+retire_online_template(struct jbig2ctx *ctx, int templ) {
+  if (ctx->classifier) jbig2classifier_retire(ctx->classifier, templ);
+  pixaReplacePix(ctx->classer->pixat, templ, pixCreate(1, 1, 1), NULL);
+  if (templ < pixaGetCount(ctx->classer->pixatd)) {
+    pixaReplacePix(ctx->classer->pixatd, templ, pixCreate(1, 1, 1), NULL);
+  }
+  ctx->online_retired.push_back(templ);
+}
+
+// -----------------------------------------------------------------------------
+// Finds a representant for every template which the classer has created since
+// the last call and redirects the components from first_component onwards to
+// the representants.
+// -----------------------------------------------------------------------------
+static void
+auto_threshold_new_templates(struct jbig2ctx *ctx, int first_component) {
+  PIXA *pixa = ctx->classer->pixat;
+  for (int i = ctx->online_representant.size(); i < pixaGetCount(pixa); i++) {
+    PIX *pix = pixa->pix[i];
+    int representant = i;
+
+    // exact duplicates are cheap to find, so look for them first
+    pixSetPadBits(pix, 0);
+    std::list<int> &exact = ctx->online_exact[hash_template_bits(pix)];
+    std::list<int>::iterator it;
+    for (it = exact.begin(); it != exact.end(); it++) {
+      l_int32 same = 0;
+      pixEqual(pixa->pix[*it], pix, &same);
+      if (same) {
+        representant = *it;
+        break;
+      }
+    }
+
+    if (representant == i) {
+      std::list<int> &bin =
+        ctx->online_bins[ctx->online_use_hash ? template_hash_key(pix) : 0];
+      for (it = bin.begin(); it != bin.end(); it++) {
+        if (jbig2enc_are_equivalent(pixa->pix[*it], pix)) {
+          representant = *it;
+          break;
+        }
+      }
+    }
+
+    if (representant == i) {
+      exact.push_back(i);
+      ctx->online_bins[ctx->online_use_hash ? template_hash_key(pix) : 0].push_back(i);
+    } else {
+      retire_online_template(ctx, i);
+    }
+    ctx->online_representant.push_back(representant);
+  }
+
+  // Only the components which made the retired templates need redirecting, but
+  // those aren't recorded, so every new component is checked.
+  NUMA *naclass = ctx->classer->naclass;
+  for (int i = first_component; i < naclass->n; i++) {
+    int n;
+    numaGetIValue(naclass, i, &n);
+    if (ctx->online_representant[n] != n) {
+      numaSetValue(naclass, i, ctx->online_representant[n]);
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Classify a page whose components have been extracted and record the results.
+// Pages must be classified in the order in which they were added.
+// -----------------------------------------------------------------------------
+static void
+classify_extracted_page(struct jbig2ctx *ctx, jbig2classifier_page *page) {
+  if (ctx->refinement) {
+    ctx->baseindexes.push_back(ctx->classer->baseindex);
+  }
+
+  const int first_component = ctx->classer->naclass->n;
+  jbig2classifier_classify(ctx->classifier, page, ctx->classer,
+                           ctx->store_templates ? &ctx->templates : NULL);
+  if (ctx->online_thresh) auto_threshold_new_templates(ctx, first_component);
+}
+
+// -----------------------------------------------------------------------------
+// Extract the components of a page (and classify them locally if the
+// classifier uses local classes) on a worker thread. The page is a private
+// copy, which is freed here.
+// -----------------------------------------------------------------------------
+static jbig2classifier_page *
+extract_page_components(PIX *bw, bool local_classes, float thresh,
+                        float weight) {
+  jbig2classifier_page *page = new jbig2classifier_page;
+  jbig2classifier_extract(page, bw);
+  if (local_classes) jbig2classifier_classify_local(page, thresh, weight);
+  pixDestroy(&bw);
+  return page;
+}
+
+// -----------------------------------------------------------------------------
+// Wait for the oldest page in flight to be extracted and classify it.
+// -----------------------------------------------------------------------------
+static void
+classify_oldest_pending_page(struct jbig2ctx *ctx) {
+  jbig2classifier_page *page = ctx->pending_pages.front().get();
+  ctx->pending_pages.pop_front();
+  classify_extracted_page(ctx, page);
+  delete page;
+}
+
+// -----------------------------------------------------------------------------
+// Wait for the pages still being extracted and classify them, in order.
+// Everything which reads the classer must call this first.
+// -----------------------------------------------------------------------------
+static void
+finish_pending_pages(struct jbig2ctx *ctx) {
+  while (!ctx->pending_pages.empty()) classify_oldest_pending_page(ctx);
+}
+
+// -----------------------------------------------------------------------------
+// Auto thresholding compares and removes the templates in the classer, so if
+// the native classifier has been putting them in the compact store they are
+// moved back, as bordered PIXs, and new templates go to the classer from now
+// on. Returns false if that isn't possible.
+// -----------------------------------------------------------------------------
+static bool
+move_templates_to_classer(struct jbig2ctx *ctx) {
+  finish_pending_pages(ctx);
+  if (!ctx->store_templates) return true;
+  if (ctx->windowed) {
+    fprintf(stderr, "auto thresholding can't be used in windowed mode\n");
+    return false;
+  }
+
+  for (int i = 0; i < (int) ctx->templates.w.size(); ++i) {
+    pixaAddPix(ctx->classer->pixat,
+               jbig2enc_templates_pix(&ctx->templates, i, JB_ADDED_PIXELS),
+               L_INSERT);
+  }
+  ctx->templates = jbig2enc_templates();
+  ctx->store_templates = false;
+  return true;
+}
+
+// see comments in .h file
+void
+jbig2enc_auto_threshold_online(struct jbig2ctx *ctx, bool use_hash) {
+  if (!ctx) {
+    fprintf(stderr, "jbig2ctx not given\n");
+    return;
+  }
+
+  if (!move_templates_to_classer(ctx)) return;
+  ctx->online_thresh = true;
+  ctx->online_use_hash = use_hash;
+}
+
 // see comments in .h file
 void
 jbig2enc_auto_threshold(struct jbig2ctx *ctx) {
@@ -357,6 +779,10 @@ jbig2enc_auto_threshold(struct jbig2ctx *ctx) {
     return;
   }
 
+  if (!move_templates_to_classer(ctx)) return;
+  remove_online_retired(ctx);
+  unite_exact_duplicates(ctx);
+
   PIXA *pixa = ctx->classer->pixat;
   for (int i = 0; i < pixaGetCount(pixa); i++) {
     PIX *pix = pixa->pix[i];
@@ -396,14 +822,7 @@ count_hash(PIX * pix, std::map<unsigned int, std::list<int> > &m, int template_i
     return 1;
   }
 
-  l_uint32 w = pixGetWidth(pix);
-  l_uint32 h = pixGetHeight(pix);
-
-  // find number of holes.
-  l_int32 holes;
-  pixCountConnComp(pix, 4, &holes);
-
-  unsigned int hash = (holes + 10 * h + 10000 * w) % 10000000;
+  unsigned int hash = template_hash_key(pix);
 
   std::map<unsigned int, std::list<int> >::iterator it = m.find(hash);
 
@@ -428,6 +847,10 @@ jbig2enc_auto_threshold_using_hash(struct jbig2ctx *ctx) {
     return;
   }
 
+  if (!move_templates_to_classer(ctx)) return;
+  remove_online_retired(ctx);
+  unite_exact_duplicates(ctx);
+
   std::map<unsigned int, std::list<int> > hashed_templates;
 
   PIXA *pixa = ctx->classer->pixat;
@@ -471,26 +894,193 @@ jbig2enc_auto_threshold_using_hash(struct jbig2ctx *ctx) {
     }
   }
 
-  std::list<int> templates_to_remove;
-  for (it = new_representants.begin(); it != new_representants.end(); it++) {
-    if (!unite_templates(ctx, it->first, it->second)) {
-      templates_to_remove.merge(it->second);
-    }
-  }
-
-  if (remove_templates(ctx, templates_to_remove)) {
-    fprintf(stderr, "warning: removing united templates wasn't fully successful");
-  }
+  unite_new_representants(ctx, new_representants);
 }
 
 // see comments in .h file
 void
 jbig2_destroy(struct jbig2ctx *ctx) {
+  while (!ctx->pending_pages.empty()) {
+    delete ctx->pending_pages.front().get();
+    ctx->pending_pages.pop_front();
+  }
   if (ctx->avg_templates) pixaDestroy(&ctx->avg_templates);
   jbClasserDestroy(&ctx->classer);
+  delete ctx->classifier;
+  for (size_t i = 0; i < ctx->spare_arenas.size(); ++i) {
+    jbig2enc_arena_dealloc(ctx->spare_arenas[i]);
+    delete ctx->spare_arenas[i];
+  }
   delete ctx;
 }
 
+// -----------------------------------------------------------------------------
+// Take one of the context's spare arenas, or a new one if they're all in use.
+// Give it back with put_arena.
+// -----------------------------------------------------------------------------
+static struct jbig2enc_arena *
+take_arena(const struct jbig2ctx *ctx) {
+  {
+    std::lock_guard<std::mutex> lock(ctx->arena_mutex);
+    if (!ctx->spare_arenas.empty()) {
+      struct jbig2enc_arena *const arena = ctx->spare_arenas.back();
+      ctx->spare_arenas.pop_back();
+      return arena;
+    }
+  }
+  struct jbig2enc_arena *const arena = new jbig2enc_arena;
+  jbig2enc_arena_init(arena);
+  return arena;
+}
+
+static void
+put_arena(const struct jbig2ctx *ctx, struct jbig2enc_arena *arena) {
+  jbig2enc_arena_reset(arena);
+  std::lock_guard<std::mutex> lock(ctx->arena_mutex);
+  ctx->spare_arenas.push_back(arena);
+}
+
+// see comments in .h file
+void
+jbig2_use_native_classifier(struct jbig2ctx *ctx, bool enable) {
+  if (!ctx->page_width.empty()) {
+    fprintf(stderr, "jbig2_use_native_classifier must be called before the "
+                    "first page is added\n");
+    return;
+  }
+
+  delete ctx->classifier;
+  ctx->classifier = NULL;
+  // Refinement and auto thresholding work on the PIXs in the classer, so the
+  // templates are only kept in the compact store without them.
+  ctx->store_templates = enable && !ctx->refinement && !ctx->online_thresh;
+  if (enable) {
+    ctx->classifier = new jbig2classifier(ctx->classer->thresh,
+                                          ctx->classer->weightfactor);
+  }
+}
+
+// see comments in .h file
+void
+jbig2_use_local_classes(struct jbig2ctx *ctx, bool enable) {
+  if (!ctx->classifier) {
+    fprintf(stderr, "jbig2_use_local_classes needs the native classifier\n");
+    return;
+  }
+
+  finish_pending_pages(ctx);
+  ctx->classifier->local_classes = enable;
+}
+
+struct jbig2_classifier_check {
+  struct JbClasser *leptonica;
+  // the native classifier's results and templates
+  struct JbClasser *native;
+  struct jbig2classifier classifier;
+  struct jbig2enc_templates templates;
+  double leptonica_seconds, native_seconds;
+
+  jbig2_classifier_check(float thresh, float weight)
+      : classifier(thresh, weight), leptonica_seconds(0), native_seconds(0) {
+    leptonica = jbCorrelationInitWithoutComponents(JB_CONN_COMPS, 9999, 9999,
+                                                   thresh, weight);
+    native = jbCorrelationInitWithoutComponents(JB_CONN_COMPS, 9999, 9999,
+                                                thresh, weight);
+  }
+  ~jbig2_classifier_check() {
+    jbClasserDestroy(&leptonica);
+    jbClasserDestroy(&native);
+  }
+};
+
+// see comments in .h file
+struct jbig2_classifier_check *
+jbig2_classifier_check_init(float thresh, float weight) {
+  return new jbig2_classifier_check(thresh, weight);
+}
+
+// see comments in .h file
+void
+jbig2_classifier_check_add_page(struct jbig2_classifier_check *check, PIX *bw) {
+  typedef std::chrono::steady_clock clock;
+  const clock::time_point start = clock::now();
+  jbAddPage(check->leptonica, bw);
+  const clock::time_point middle = clock::now();
+  jbig2classifier_page page;
+  jbig2classifier_extract(&page, bw);
+  jbig2classifier_classify(&check->classifier, &page, check->native,
+                           &check->templates);
+  const clock::time_point end = clock::now();
+
+  check->leptonica_seconds +=
+    std::chrono::duration<double>(middle - start).count();
+  check->native_seconds += std::chrono::duration<double>(end - middle).count();
+}
+
+// see comments in .h file
+void
+jbig2_classifier_check_result(const struct jbig2_classifier_check *check,
+                              struct jbig2_classifier_comparison *result) {
+  const struct JbClasser *const leptonica = check->leptonica;
+  const struct JbClasser *const native = check->native;
+  memset(result, 0, sizeof(*result));
+  result->pages = leptonica->npages;
+  result->components = leptonica->naclass->n;
+  result->leptonica_templates = leptonica->nclass;
+  result->native_templates = native->nclass;
+  result->leptonica_seconds = check->leptonica_seconds;
+  result->native_seconds = check->native_seconds;
+
+  // The templates of the two are numbered differently once they have made
+  // a single different decision, so the classes are compared as groupings: a
+  // component is in a different class if the first component of its class
+  // under one classifier was put in another class by the other.
+  std::vector<int> leptonica_to_native(leptonica->nclass, -1);
+  std::vector<int> native_to_leptonica(native->nclass, -1);
+  const int n = std::min(leptonica->naclass->n, native->naclass->n);
+  result->different_class = result->components - n;
+  for (int i = 0; i < n; ++i) {
+    int lclass, nclass;
+    numaGetIValue(leptonica->naclass, i, &lclass);
+    numaGetIValue(native->naclass, i, &nclass);
+    if (leptonica_to_native[lclass] < 0) leptonica_to_native[lclass] = nclass;
+    if (native_to_leptonica[nclass] < 0) native_to_leptonica[nclass] = lclass;
+    if (leptonica_to_native[lclass] != nclass ||
+        native_to_leptonica[nclass] != lclass) {
+      result->different_class++;
+      continue;
+    }
+
+    int lx, ly, nx, ny;
+    ptaGetIPt(leptonica->ptaul, i, &lx, &ly);
+    ptaGetIPt(native->ptaul, i, &nx, &ny);
+    const int offset = std::max(abs(lx - nx), abs(ly - ny));
+    if (offset) {
+      result->different_place++;
+      result->max_offset = std::max(result->max_offset, offset);
+    }
+  }
+}
+
+// see comments in .h file
+void
+jbig2_classifier_check_destroy(struct jbig2_classifier_check *check) {
+  delete check;
+}
+
+// see comments in .h file
+void
+jbig2_split_global_dictionary(struct jbig2ctx *ctx, int ndicts) {
+  ctx->global_dictionaries = ndicts < 1 ? 1 : ndicts;
+}
+
+// see comments in .h file
+void
+jbig2_set_ingest_threads(struct jbig2ctx *ctx, int nthreads) {
+  finish_pending_pages(ctx);
+  ctx->ingest_threads = nthreads < 1 ? 1 : nthreads;
+}
+
 // see comments in .h file
 void
 jbig2_add_page(struct jbig2ctx *ctx, struct Pix *input) {
@@ -502,11 +1092,37 @@ jbig2_add_page(struct jbig2ctx *ctx, struct Pix *input) {
     bw = pixClone(input);
   }
 
-  if (ctx->refinement) {
-    ctx->baseindexes.push_back(ctx->classer->baseindex);
-  }
+  if (ctx->classifier && ctx->ingest_threads > 1) {
+    // Leptonica's reference counts aren't atomic, so the worker gets its own
+    // copy of the page rather than a clone.
+    ctx->pending_pages.push_back(std::async(std::launch::async,
+                                            extract_page_components,
+                                            pixCopy(NULL, bw),
+                                            ctx->classifier->local_classes,
+                                            ctx->classifier->thresh,
+                                            ctx->classifier->weight));
+    // Classify the oldest page while the newer ones are extracted. This keeps
+    // at most ingest_threads pages in flight and their order stable.
+    while ((int) ctx->pending_pages.size() >= ctx->ingest_threads) {
+      classify_oldest_pending_page(ctx);
+    }
+  } else if (ctx->classifier) {
+    jbig2classifier_page page;
+    jbig2classifier_extract(&page, bw);
+    if (ctx->classifier->local_classes) {
+      jbig2classifier_classify_local(&page, ctx->classifier->thresh,
+                                     ctx->classifier->weight);
+    }
+    classify_extracted_page(ctx, &page);
+  } else {
+    if (ctx->refinement) {
+      ctx->baseindexes.push_back(ctx->classer->baseindex);
+    }
 
-  jbAddPage(ctx->classer, bw);
+    const int first_component = ctx->classer->naclass->n;
+    jbAddPage(ctx->classer, bw);
+    if (ctx->online_thresh) auto_threshold_new_templates(ctx, first_component);
+  }
   ctx->page_width.push_back(bw->w);
   ctx->page_height.push_back(bw->h);
   ctx->page_xres.push_back(bw->xres);
@@ -526,32 +1142,243 @@ jbig2_add_page(struct jbig2ctx *ctx, struct Pix *input) {
   pixDestroy(&bw);
 }
 
-#define F(x) memcpy(ret + offset, &x, sizeof(x)) ; offset += sizeof(x)
-#define G(x, y) memcpy(ret + offset, x, y); offset += y;
-#define SEGMENT(x) x.write(ret + offset); offset += x.size();
-
 // see comments in .h file
-uint8_t *
-jbig2_pages_complete(struct jbig2ctx *ctx, int *const length, bool verbose) {
-  /*
-     Graying support - disabled.
-     It's not very clear that graying actually buys you much extra quality
-     above pick-the-first. Also, aligning the gray glyphs requires the
-     original source image.
-
-     Remember that you need the Init without WithoutComponents to use this */
+void
+jbig2_add_page_raw(struct jbig2ctx *ctx, const u8 *data, int width, int height,
+                   int stride, enum jbig2_bit_order order, int xres, int yres) {
+  // The classifiers work on connected components found by Leptonica, so the
+  // page is copied into a Pix: a row at a time, with a single byte swap for
+  // the whole image.
+  PIX *pix = pixCreate(width, height, 1);
+  const int nbytes = (width + 7) / 8;
+  const int wpl = pixGetWpl(pix);
+  for (int y = 0; y < height; ++y) {
+    u8 *const row = (u8 *) (pixGetData(pix) + (size_t) y * wpl);
+    const u8 *const src = data + (size_t) y * stride;
+    if (order == JBIG2_LSB_FIRST) {
+      for (int i = 0; i < nbytes; ++i) {
+        u8 b = src[i];
+        b = ((b & 0xf0) >> 4) | ((b & 0x0f) << 4);
+        b = ((b & 0xcc) >> 2) | ((b & 0x33) << 2);
+        b = ((b & 0xaa) >> 1) | ((b & 0x55) << 1);
+        row[i] = b;
+      }
+    } else {
+      memcpy(row, src, nbytes);
+    }
+  }
+  pixEndianByteSwap(pix);
+  pixSetPadBits(pix, 0);
+  pixSetResolution(pix, xres, yres);
+  jbig2_add_page(ctx, pix);
+  pixDestroy(&pix);
+}
 
+// -----------------------------------------------------------------------------
+// Returns true if a symbol of the given size, used on pages_used of the npages
+// pages, should go in the global dictionary rather than in the tables of the
+// pages which use it.
+//
+// A global symbol is coded once but, since some PDF readers decode the global
+// dictionary for every page, its pixels are decoded npages times. A page
+// symbol is coded and decoded once for each page it is on. The cost of each is
+// the (estimated) coded size plus decode_weight bytes for each pixel decoded,
+// and the cheaper one wins. With no weight, every symbol on more than one page
+// is global.
+// -----------------------------------------------------------------------------
+static bool
+symbol_is_global(const struct jbig2ctx *ctx, int w, int h, int pages_used,
+                 int npages) {
+  if (pages_used <= 1) return false;
+
+  const double pixels = (double) w * h;
+  // a rough guess at the size of a generic region coded symbol, plus the
+  // height and width deltas
+  const double size = 2 + pixels / 50;
+  const double global_cost = size + ctx->decode_weight * pixels * npages;
+  const double page_cost = pages_used * (size + ctx->decode_weight * pixels);
+  return global_cost <= page_cost;
+}
 
-  /*NUMA *samples_per_composition;
-  PTA *grayed_centroids;
-  PIXA *grayed;
+// see comments in .h file
+void
+jbig2_set_decode_cost_weight(struct jbig2ctx *ctx, float weight) {
+  ctx->decode_weight = weight < 0 ? 0 : weight;
+}
 
-  grayed = jbAccumulateComposites(ctx->classer->pixaa, &samples_per_composition,
-                                  &grayed_centroids);
+#define F(x) memcpy(ret + offset, &x, sizeof(x)) ; offset += sizeof(x)
+#define G(x, y) memcpy(ret + offset, x, y); offset += y;
+#define SEGMENT(x) x.write(ret + offset); offset += x.size();
 
-  if (!grayed || grayed->n != ctx->classer->pixaa->n) {
-    fprintf(stderr, "Graying failed\n");
-    return NULL;
+// -----------------------------------------------------------------------------
+// Write a symbol table segment, whose data has been coded in ectx, to ret and
+// return the number of bytes written.
+// -----------------------------------------------------------------------------
+static int
+write_symbol_table(u8 *ret, Segment *seg, const struct jbig2_symbol_dict &symtab,
+                   struct jbig2enc_ctx *ectx) {
+  int offset = 0;
+  SEGMENT((*seg));
+  F(symtab);
+  jbig2enc_tobuffer(ectx, ret + offset);
+  offset += jbig2enc_datasize(ectx);
+  return offset;
+}
+
+// -----------------------------------------------------------------------------
+// Returns the number of symbols which two sorted lists have in common
+// -----------------------------------------------------------------------------
+static int
+count_common(const std::vector<int> &a, const std::vector<int> &b) {
+  int common = 0;
+  for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+    if (a[i] < b[j]) {
+      i++;
+    } else if (b[j] < a[i]) {
+      j++;
+    } else {
+      common++;
+      i++;
+      j++;
+    }
+  }
+  return common;
+}
+
+// -----------------------------------------------------------------------------
+// Group the pages into (up to) nclusters clusters of pages which use the same
+// symbols, considering only the symbols for which candidates is true. Fills
+// page_cluster with the cluster of each page and returns the number of
+// clusters.
+//
+// This is k-means over the rows of the page x symbol usage matrix. A page
+// joins the cluster in which the symbols it uses are the most common, scored
+// by the fraction of the cluster's pages which use each of them. The clusters
+// are seeded with pages which are as unlike each other as possible: each seed
+// is the page whose symbols overlap least (by Jaccard index) with those of the
+// seeds so far. Empty clusters are dropped.
+// -----------------------------------------------------------------------------
+static int
+cluster_pages(const struct jbig2ctx *ctx, const std::vector<bool> &candidates,
+              int nclusters, std::vector<int> *page_cluster) {
+  const int npages = ctx->classer->npages;
+
+  // the candidate symbols are numbered densely, and each page gets the sorted
+  // list of the candidates which it uses
+  std::vector<int> candidate_index(candidates.size(), -1);
+  int ncandidates = 0;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if (candidates[i]) candidate_index[i] = ncandidates++;
+  }
+  std::vector<std::vector<int> > page_symbols(npages);
+  for (int i = 0; i < ctx->classer->naclass->n; ++i) {
+    int n, page_num;
+    numaGetIValue(ctx->classer->naclass, i, &n);
+    numaGetIValue(ctx->classer->napage, i, &page_num);
+    if (candidate_index[n] >= 0) page_symbols[page_num].push_back(candidate_index[n]);
+  }
+  for (int p = 0; p < npages; ++p) {
+    std::vector<int> &syms = page_symbols[p];
+    std::sort(syms.begin(), syms.end());
+    syms.erase(std::unique(syms.begin(), syms.end()), syms.end());
+  }
+
+  if (nclusters > npages) nclusters = npages;
+  std::vector<int> seeds(1, 0);
+  // the greatest similarity of each page to any of the seeds
+  std::vector<double> closest(npages, -1);
+  while ((int) seeds.size() < nclusters) {
+    const std::vector<int> &seed = page_symbols[seeds.back()];
+    int next = -1;
+    for (int p = 0; p < npages; ++p) {
+      const int common = count_common(seed, page_symbols[p]);
+      const int total = seed.size() + page_symbols[p].size() - common;
+      const double similarity = total ? (double) common / total : 1;
+      if (similarity > closest[p]) closest[p] = similarity;
+      if (closest[p] < 1 && (next < 0 || closest[p] < closest[next])) next = p;
+    }
+    // every page is the same as one of the seeds
+    if (next < 0) break;
+    seeds.push_back(next);
+  }
+  nclusters = seeds.size();
+
+  page_cluster->assign(npages, -1);
+  for (int c = 0; c < nclusters; ++c) (*page_cluster)[seeds[c]] = c;
+  // the number of pages of each cluster using each symbol, and the number of
+  // pages in each cluster
+  std::vector<int> uses((size_t) nclusters * ncandidates);
+  std::vector<int> size(nclusters);
+  for (int iteration = 0; iteration < 20; ++iteration) {
+    std::fill(uses.begin(), uses.end(), 0);
+    std::fill(size.begin(), size.end(), 0);
+    for (int p = 0; p < npages; ++p) {
+      const int c = (*page_cluster)[p];
+      if (c < 0) continue;
+      size[c]++;
+      for (size_t i = 0; i < page_symbols[p].size(); ++i) {
+        uses[(size_t) c * ncandidates + page_symbols[p][i]]++;
+      }
+    }
+
+    bool changed = false;
+    for (int p = 0; p < npages; ++p) {
+      int best = (*page_cluster)[p] < 0 ? 0 : (*page_cluster)[p];
+      double best_score = -1;
+      for (int c = 0; c < nclusters; ++c) {
+        if (!size[c]) continue;
+        const int *const cluster_uses = &uses[(size_t) c * ncandidates];
+        double score = 0;
+        for (size_t i = 0; i < page_symbols[p].size(); ++i) {
+          score += cluster_uses[page_symbols[p][i]];
+        }
+        score /= size[c];
+        if (score > best_score) {
+          best = c;
+          best_score = score;
+        }
+      }
+      if (best != (*page_cluster)[p]) {
+        (*page_cluster)[p] = best;
+        changed = true;
+      }
+    }
+    if (!changed) break;
+  }
+
+  // number the clusters which have pages consecutively
+  std::vector<int> number(nclusters, -1);
+  int used = 0;
+  for (int p = 0; p < npages; ++p) {
+    int &c = (*page_cluster)[p];
+    if (number[c] < 0) number[c] = used++;
+    c = number[c];
+  }
+  return used;
+}
+
+// see comments in .h file
+uint8_t *
+jbig2_pages_complete(struct jbig2ctx *ctx, int *const length, bool verbose) {
+  /*
+     Graying support - disabled.
+     It's not very clear that graying actually buys you much extra quality
+     above pick-the-first. Also, aligning the gray glyphs requires the
+     original source image.
+
+     Remember that you need the Init without WithoutComponents to use this */
+
+
+  /*NUMA *samples_per_composition;
+  PTA *grayed_centroids;
+  PIXA *grayed;
+
+  grayed = jbAccumulateComposites(ctx->classer->pixaa, &samples_per_composition,
+                                  &grayed_centroids);
+
+  if (!grayed || grayed->n != ctx->classer->pixaa->n) {
+    fprintf(stderr, "Graying failed\n");
+    return NULL;
   }
 
   ctx->avg_templates = pixaCreate(0);
@@ -574,50 +1401,142 @@ jbig2_pages_complete(struct jbig2ctx *ctx, int *const length, bool verbose) {
   // the size of the global dictionary down as some PDF readers appear to
   // decode it for every page (!)
 
-  // (as a short cut, we just pick the symbols which are only used once since,
-  // in testing, all the symbols which appear on only one page appear only once
-  // on that page)
+  // (with a decode cost weight, symbols which appear on a few pages may go in
+  // the dictionaries of those pages too, see symbol_is_global)
+
+  if (ctx->windowed) {
+    fprintf(stderr, "jbig2_pages_complete can't be used in windowed mode, "
+                    "use jbig2_flush_window\n");
+    return NULL;
+  }
+
+  finish_pending_pages(ctx);
+  remove_online_retired(ctx);
+
+  // Streamed pages are classified against the templates of the sample, so the
+  // classifier must still agree with the store about them.
+  if (ctx->stream_after_sample && !ctx->store_templates) {
+    fprintf(stderr, "auto thresholding can't be used with "
+                    "jbig2_stream_after_sample\n");
+    return NULL;
+  }
+
+  // The templates only need to be read from now on, so they are moved to a
+  // compact store without Leptonica's border, unless the classifier has been
+  // putting them there all along. (Refinement still needs the PIXs though.)
+  if (!ctx->store_templates) {
+    PIXA *const pixa =
+      ctx->avg_templates ? ctx->avg_templates : ctx->classer->pixat;
+    const int border = ctx->avg_templates ? 0 : JB_ADDED_PIXELS;
+    const bool free_templates = !ctx->refinement && pixa == ctx->classer->pixat;
+    for (int i = 0; i < pixa->n; ++i) {
+      jbig2enc_templates_add(&ctx->templates, pixa->pix[i], border);
+      if (free_templates) pixDestroy(&pixa->pix[i]);
+    }
+    if (free_templates) pixaClear(pixa);
+  }
+  const struct jbig2enc_templates *const symbols = &ctx->templates;
 
   const bool single_page = ctx->classer->npages == 1;
+  const int npages = ctx->classer->npages;
 
-  // maps symbol number to the number of times it has been used
-  // pixat->n is the number of symbols
+  // maps symbol number to the number of pages it is used on
   // naclass->n is the number of connected components
-
-  std::vector<unsigned> symbol_used(ctx->classer->pixat->n);
+  // The components of each page are consecutive, so a symbol is on a new page
+  // whenever it is seen on a different page from the last time.
+  const int nsymbols = symbols->w.size();
+  std::vector<unsigned> pages_used(nsymbols);
+  std::vector<int> last_page(nsymbols, -1);
   for (int i = 0; i < ctx->classer->naclass->n; ++i) {
-    int n;
+    int n, page_num;
     numaGetIValue(ctx->classer->naclass, i, &n);
-    symbol_used[n]++;
+    numaGetIValue(ctx->classer->napage, i, &page_num);
+    if (last_page[n] != page_num) pages_used[n]++;
+    last_page[n] = page_num;
   }
 
-  // the multiuse symbols are the ones which go into the global dictionary
+  // the global symbols are the ones which go into the global dictionary
   std::vector<unsigned> multiuse_symbols;
-  for (int i = 0; i < ctx->classer->pixat->n; ++i) {
-    if (symbol_used[i] == 0) abort();
-    if (symbol_used[i] > 1 || single_page) multiuse_symbols.push_back(i);
+  std::vector<bool> global(nsymbols);
+  for (int i = 0; i < nsymbols; ++i) {
+    if (pages_used[i] == 0) abort();
+    global[i] = single_page ||
+                symbol_is_global(ctx, symbols->w[i], symbols->h[i],
+                                 pages_used[i], npages);
+  }
+
+  // With page clusters, a symbol which would be global but is only used by the
+  // pages of one cluster goes in that cluster's dictionary instead.
+  std::vector<int> symbol_cluster(nsymbols, -1);
+  std::vector<std::vector<unsigned> > cluster_symbols;
+  ctx->page_cluster.clear();
+  if (ctx->page_clusters > 1 && !single_page && !ctx->stream_after_sample) {
+    const int nclusters = cluster_pages(ctx, global, ctx->page_clusters,
+                                        &ctx->page_cluster);
+    // the cluster of the first page each symbol is on, and whether it is on
+    // the pages of any other cluster
+    std::vector<int> first_cluster(nsymbols, -1);
+    std::vector<bool> other_clusters(nsymbols);
+    for (int i = 0; i < ctx->classer->naclass->n; ++i) {
+      int n, page_num;
+      numaGetIValue(ctx->classer->naclass, i, &n);
+      numaGetIValue(ctx->classer->napage, i, &page_num);
+      const int cluster = ctx->page_cluster[page_num];
+      if (first_cluster[n] < 0) {
+        first_cluster[n] = cluster;
+      } else if (first_cluster[n] != cluster) {
+        other_clusters[n] = true;
+      }
+    }
+    // with one cluster, its dictionary would just be the global one
+    if (nclusters > 1) {
+      cluster_symbols.resize(nclusters);
+      for (int i = 0; i < nsymbols; ++i) {
+        if (global[i] && !other_clusters[i]) {
+          global[i] = false;
+          symbol_cluster[i] = first_cluster[i];
+          cluster_symbols[first_cluster[i]].push_back(i);
+        }
+      }
+    } else {
+      ctx->page_cluster.clear();
+    }
+  }
+  for (int i = 0; i < nsymbols; ++i) {
+    if (global[i]) multiuse_symbols.push_back(i);
   }
   ctx->num_global_symbols = multiuse_symbols.size();
 
-  // build the pagecomps map: a map from page number to the list of connected
-  // components for that page. The classer gives us an array from connected
-  // component number to page number - we just have to reverse it
+  // build the page_comps and single_use_symbols arrays. The classer gives us
+  // an array from connected component number to page number, in which the
+  // components of each page are consecutive, so we count the components (and
+  // the symbols of the page's own table) of each page and then sum the counts
+  ctx->page_comps.assign(npages + 1, 0);
+  ctx->single_use_start.assign(npages + 1, 0);
+  ctx->single_use_symbols.clear();
+  last_page.assign(nsymbols, -1);
   for (int i = 0; i < ctx->classer->napage->n; ++i) {
     int page_num;
     numaGetIValue(ctx->classer->napage, i, &page_num);
-    ctx->pagecomps[page_num].push_back(i);
+    ctx->page_comps[page_num + 1]++;
     int symbol;
     numaGetIValue(ctx->classer->naclass, i, &symbol);
-    if (symbol_used[symbol] == 1 && !single_page) {
-      ctx->single_use_symbols[page_num].push_back(symbol);
+    if (!global[symbol] && symbol_cluster[symbol] < 0 &&
+        last_page[symbol] != page_num) {
+      ctx->single_use_symbols.push_back(symbol);
+      ctx->single_use_start[page_num + 1]++;
     }
+    last_page[symbol] = page_num;
+  }
+  for (int p = 0; p < npages; ++p) {
+    ctx->page_comps[p + 1] += ctx->page_comps[p];
+    ctx->single_use_start[p + 1] += ctx->single_use_start[p];
   }
 
 #ifdef DUMP_SYMBOL_GRAPH
   for (int p = 0; p < ctx->classer->npages; ++p) {
-    for (std::vector<int>::const_iterator i = ctx->pagecomps[p].begin();
-         i != ctx->pagecomps[p].end(); ++i) {
-      const int sym = (int) ctx->classer->naclass->array[*i];
+    for (int i = ctx->page_comps[p]; i < ctx->page_comps[p + 1]; ++i) {
+      const int sym = (int) ctx->classer->naclass->array[i];
       fprintf(stderr, "S: %d %d\n", p, sym);
     }
   }
@@ -630,12 +1549,11 @@ jbig2_pages_complete(struct jbig2ctx *ctx, int *const length, bool verbose) {
   }
 
   for (int p = 0; p < ctx->classer->npages; ++p) {
-    const int numcomps = ctx->pagecomps[p].size();
+    const int numcomps = ctx->page_comps[p + 1] - ctx->page_comps[p];
     int unique_in_doc = 0;
     std::map<int, int> symcount;
-    for (std::vector<int>::const_iterator i = ctx->pagecomps[p].begin();
-         i != ctx->pagecomps[p].end(); ++i) {
-      const int sym = (int) ctx->classer->naclass->array[*i];
+    for (int i = ctx->page_comps[p]; i < ctx->page_comps[p + 1]; ++i) {
+      const int sym = (int) ctx->classer->naclass->array[i];
       symcount[sym]++;
       if (usecount[sym] == 1) unique_in_doc++;
     }
@@ -651,82 +1569,251 @@ jbig2_pages_complete(struct jbig2ctx *ctx, int *const length, bool verbose) {
 
 #ifdef DUMP_ALL_SYMBOLS
   char filenamebuf[128];
-  for (int i = 0; i < ctx->classer->pixat->n; ++i) {
+  for (int i = 0; i < nsymbols; ++i) {
     sprintf(filenamebuf, "sym-%d.png", i);
-    pixWrite(filenamebuf, ctx->classer->pixat->pix[i], IFF_PNG);
+    PIX *pix = jbig2enc_templates_pix(symbols, i, 0);
+    pixWrite(filenamebuf, pix, IFF_PNG);
+    pixDestroy(&pix);
   }
 #endif
   if (verbose) {
     fprintf(stderr, "JBIG2 compression complete. pages:%d symbols:%d log2:%d\n",
-            ctx->classer->npages, ctx->classer->pixat->n,
-            log2up(ctx->classer->pixat->n));
+            ctx->classer->npages, nsymbols, log2up(nsymbols));
   }
-  jbGetLLCorners(ctx->classer);
 
-  struct jbig2enc_ctx ectx;
-  jbig2enc_init(&ectx);
+  // jbGetLLCorners can't be used since the classer no longer has the
+  // templates
+  ptaDestroy(&ctx->classer->ptall);
+  ctx->classer->ptall = ptaCreate(ctx->classer->naclass->n);
+  for (int i = 0; i < ctx->classer->naclass->n; ++i) {
+    int t, x, y;
+    numaGetIValue(ctx->classer->naclass, i, &t);
+    ptaGetIPt(ctx->classer->ptaul, i, &x, &y);
+    ptaAddPt(ctx->classer->ptall, x, y + symbols->h[t] - 1);
+  }
 
+  // If pages will be streamed after these, the number of pages isn't known
+  // and the file header leaves it out.
   struct jbig2_file_header header;
+  const int header_size = ctx->stream_after_sample ?
+    sizeof(header) - sizeof(header.n_pages) : sizeof(header);
   if (ctx->full_headers) {
     memset(&header, 0, sizeof(header));
     header.n_pages = htonl(ctx->classer->npages);
     header.organisation_type = 1;
+    header.unknown_n_pages = ctx->stream_after_sample;
     memcpy(&header.id, JBIG2_FILE_MAGIC, 8);
   }
 
-  Segment seg;
-  struct jbig2_symbol_dict symtab;
-  memset(&symtab, 0, sizeof(symtab));
+  ctx->symmap.assign(symbols->w.size(), -1);
+
+  // Split the global symbols into (up to) global_dictionaries tables of about
+  // the same size. A height class is never split, so each table can be coded
+  // on its own. dict_start[k] is the index in global_order of the first symbol
+  // of table k.
+  std::vector<unsigned> global_order;
+  jbig2enc_symbol_order(symbols, multiuse_symbols.data(),
+                        multiuse_symbols.size(), &global_order);
+  const unsigned num_global = global_order.size();
+  std::vector<unsigned> dict_start(1, 0);
+  for (int k = 1; k < ctx->global_dictionaries; ++k) {
+    unsigned cut = (unsigned) ((u64) num_global * k / ctx->global_dictionaries);
+    while (cut < num_global &&
+           symbols->h[global_order[cut]] == symbols->h[global_order[cut - 1]]) {
+      cut++;
+    }
+    if (cut >= num_global) break;
+    if (cut > dict_start.back()) dict_start.push_back(cut);
+  }
+  dict_start.push_back(num_global);
+  const int ndicts = dict_start.size() - 1;
+
+  // Then come the dictionaries of the page clusters, if any. Their symbols are
+  // numbered after the global ones, since a page refers to the global
+  // dictionaries and to its cluster's.
+  const int nclusters = cluster_symbols.size();
+  const int ntables = ndicts + nclusters;
+  std::vector<const unsigned *> table_symbols(ntables);
+  std::vector<int> table_size(ntables), table_first_id(ntables);
+  for (int k = 0; k < ndicts; ++k) {
+    table_symbols[k] = global_order.data() + dict_start[k];
+    table_size[k] = dict_start[k + 1] - dict_start[k];
+    table_first_id[k] = dict_start[k];
+  }
+  ctx->cluster_nsymbols.resize(nclusters);
+  for (int c = 0; c < nclusters; ++c) {
+    table_symbols[ndicts + c] = cluster_symbols[c].data();
+    table_size[ndicts + c] = ctx->cluster_nsymbols[c] = cluster_symbols[c].size();
+    table_first_id[ndicts + c] = num_global;
+  }
 
-  jbig2enc_symboltable
-    (&ectx, ctx->avg_templates ? ctx->avg_templates : ctx->classer->pixat,
-     &multiuse_symbols, &ctx->symmap, ctx->avg_templates == NULL);
-  const int symdatasize = jbig2enc_datasize(&ectx);
-
-  symtab.a1x = 3;
-  symtab.a1y = -1;
-  symtab.a2x = -3;
-  symtab.a2y = -1;
-  symtab.a3x = 2;
-  symtab.a3y = -2;
-  symtab.a4x = -2;
-  symtab.a4y = -2;
-  symtab.exsyms = symtab.newsyms = htonl(multiuse_symbols.size());
-
-  ctx->symtab_segment = ctx->segnum;
-  seg.number = ctx->segnum;
-  ctx->segnum++;
-  seg.type = segment_symbol_table;
-  seg.len = sizeof(symtab) + symdatasize;
-  seg.page = 0;
-  seg.retain_bits = 1;
-
-  u8 *const ret = (u8 *) malloc((ctx->full_headers ? sizeof(header) : 0) +
-                                seg.size() + sizeof(symtab) + symdatasize);
+  // The tables are independent, so they are coded in parallel. Each writes to
+  // different elements of the symbol map.
+  std::vector<struct jbig2enc_ctx> ectx(ntables);
+  std::vector<struct jbig2enc_arena *> arenas(ntables);
+  std::vector<std::thread> threads;
+  for (int k = 0; k < ntables; ++k) {
+    arenas[k] = take_arena(ctx);
+    jbig2enc_init_arena(&ectx[k], arenas[k]);
+    if (k + 1 < ntables) {
+      threads.push_back(std::thread(jbig2enc_symboltable, &ectx[k], symbols,
+                                    table_symbols[k], table_size[k],
+                                    &ctx->symmap, table_first_id[k]));
+    } else {
+      jbig2enc_symboltable(&ectx[k], symbols, table_symbols[k], table_size[k],
+                           &ctx->symmap, table_first_id[k]);
+    }
+  }
+  for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+
+  // Without full headers, the cluster dictionaries are kept apart since each
+  // is embedded with the global ones (see jbig2_cluster_symbols).
+  std::vector<Segment> segs(ntables);
+  std::vector<struct jbig2_symbol_dict> symtabs(ntables);
+  int totalsize = ctx->full_headers ? header_size : 0;
+  ctx->symtab_segments.clear();
+  ctx->cluster_segnum.resize(nclusters);
+  for (int k = 0; k < ntables; ++k) {
+    struct jbig2_symbol_dict &symtab = symtabs[k];
+    memset(&symtab, 0, sizeof(symtab));
+    symtab.a1x = 3;
+    symtab.a1y = -1;
+    symtab.a2x = -3;
+    symtab.a2y = -1;
+    symtab.a3x = 2;
+    symtab.a3y = -2;
+    symtab.a4x = -2;
+    symtab.a4y = -2;
+    symtab.exsyms = symtab.newsyms = htonl(table_size[k]);
+
+    Segment &seg = segs[k];
+    if (k < ndicts) {
+      ctx->symtab_segments.push_back(ctx->segnum);
+    } else {
+      ctx->cluster_segnum[k - ndicts] = ctx->segnum;
+    }
+    seg.number = ctx->segnum;
+    ctx->segnum++;
+    seg.type = segment_symbol_table;
+    seg.len = sizeof(symtab) + jbig2enc_datasize(&ectx[k]);
+    seg.page = 0;
+    seg.retain_bits = 1;
+    if (k < ndicts || ctx->full_headers) totalsize += seg.size() + seg.len;
+  }
+
+  // Number the symbols of the per-page symbol tables and the segments of every
+  // page now, so that jbig2_produce_page doesn't need to change the context.
+  std::vector<unsigned> page_symbols;
+  ctx->page_segnum.resize(npages);
+  for (int p = 0; p < npages; ++p) {
+    const int num_single_use_symbols =
+      ctx->single_use_start[p + 1] - ctx->single_use_start[p];
+    const int first_id = ctx->num_global_symbols +
+      (nclusters ? ctx->cluster_nsymbols[ctx->page_cluster[p]] : 0);
+    jbig2enc_symbol_order(symbols,
+                          ctx->single_use_symbols.data() + ctx->single_use_start[p],
+                          num_single_use_symbols, &page_symbols);
+    // A symbol in the tables of several pages has a different number on each,
+    // which jbig2_produce_page works out for itself.
+    for (int i = 0; i < num_single_use_symbols; ++i) {
+      if (pages_used[page_symbols[i]] == 1) {
+        ctx->symmap[page_symbols[i]] = first_id + i;
+      }
+    }
+
+    // page information, (symbol table), text region, (end of page)
+    ctx->page_segnum[p] = ctx->segnum;
+    ctx->segnum += 2 + (num_single_use_symbols > 0) + ctx->full_headers;
+  }
+
+  // The single use symbols of the sample are in the symbol tables of their
+  // pages, which later pages can't refer to, so they aren't matched any more.
+  if (ctx->stream_after_sample) {
+    for (size_t i = 0; i < ctx->single_use_symbols.size(); ++i) {
+      jbig2classifier_retire(ctx->classifier, ctx->single_use_symbols[i]);
+    }
+    ctx->sample_pages = npages;
+    ctx->sample_templates = symbols->w.size();
+    ctx->sample_comps = ctx->classer->naclass->n;
+    ctx->sample_single_use = ctx->single_use_symbols.size();
+  }
+
+  u8 *const ret = (u8 *) malloc(totalsize);
   int offset = 0;
   if (ctx->full_headers) {
-    F(header);
+    G(&header, header_size);
+  }
+  ctx->cluster_dicts.resize(ctx->full_headers ? 0 : nclusters);
+  for (int k = 0; k < ntables; ++k) {
+    if (k < ndicts || ctx->full_headers) {
+      offset += write_symbol_table(ret + offset, &segs[k], symtabs[k], &ectx[k]);
+    } else {
+      std::vector<uint8_t> &dict = ctx->cluster_dicts[k - ndicts];
+      dict.resize(segs[k].size() + segs[k].len);
+      write_symbol_table(dict.data(), &segs[k], symtabs[k], &ectx[k]);
+    }
+    jbig2enc_dealloc(&ectx[k]);
+    put_arena(ctx, arenas[k]);
   }
-  SEGMENT(seg);
-  F(symtab);
-  jbig2enc_tobuffer(&ectx, ret + offset);
-  jbig2enc_dealloc(&ectx);
-  offset += symdatasize;
 
+  if (totalsize != offset) abort();
   *length = offset;
 
   return ret;
 }
 
+// see comments in .h file
+void
+jbig2_set_page_clusters(struct jbig2ctx *ctx, int nclusters) {
+  ctx->page_clusters = nclusters < 1 ? 1 : nclusters;
+}
+
+// see comments in .h file
+int
+jbig2_page_clusters(const struct jbig2ctx *ctx) {
+  return ctx->cluster_nsymbols.size();
+}
+
+// see comments in .h file
+int
+jbig2_page_cluster(const struct jbig2ctx *ctx, int page_no) {
+  if (ctx->page_cluster.empty()) return -1;
+  return ctx->page_cluster[page_no];
+}
+
 // see comments in .h file
 uint8_t *
-jbig2_produce_page(struct jbig2ctx *ctx, int page_no,
-                   int xres, int yres, int *const length) {
-  const bool last_page = page_no == ctx->classer->npages;
+jbig2_cluster_symbols(const struct jbig2ctx *ctx, int cluster,
+                      int *const length) {
+  if (cluster < 0 || cluster >= (int) ctx->cluster_dicts.size()) {
+    *length = 0;
+    return NULL;
+  }
+
+  const std::vector<uint8_t> &dict = ctx->cluster_dicts[cluster];
+  uint8_t *const ret = (uint8_t *) malloc(dict.size());
+  memcpy(ret, dict.data(), dict.size());
+  *length = dict.size();
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// Encode a page (see jbig2_produce_page), taking the coders' memory from arena.
+// The arena may be reset once this returns.
+// -----------------------------------------------------------------------------
+static uint8_t *
+produce_page(const struct jbig2ctx *ctx, int page_no, int xres, int yres,
+             int *const length, struct jbig2enc_arena *arena) {
+  // Windowed and streamed output is ended by the caller (see
+  // jbig2_flush_window and jbig2_stream_trailer).
+  const bool last_page = !ctx->windowed && !ctx->stream_after_sample &&
+                         page_no == ctx->classer->npages - 1;
   const bool include_trailer = last_page && ctx->full_headers;
+  const int p = page_no - ctx->first_page;
+  int segnum = ctx->page_segnum[p];
 
   struct jbig2enc_ctx ectx;
-  jbig2enc_init(&ectx);
+  jbig2enc_init_arena(&ectx, arena);
 
   Segment seg, symseg;
   Segment endseg, trailerseg;
@@ -741,8 +1828,8 @@ jbig2_produce_page(struct jbig2ctx *ctx, int page_no,
   Segment segr;
 
   // page information segment
-  seg.number = ctx->segnum;
-  ctx->segnum++;
+  seg.number = segnum;
+  segnum++;
   seg.type = segment_page_information;
   seg.page = ctx->pdf_page_numbering ? 1 : 1 + page_no;
   seg.len = sizeof(struct jbig2_page_info);
@@ -752,27 +1839,53 @@ jbig2_produce_page(struct jbig2ctx *ctx, int page_no,
   pageinfo.yres = htonl(yres == -1 ? ctx->page_yres[page_no] : yres );
   pageinfo.is_lossless = ctx->refinement;
 
-  std::map<int, int> second_symbol_map;
   // If we have single-use symbols on this page we make a new symbol table
   // containing just them.
-  const bool extrasymtab = ctx->single_use_symbols[page_no].size() > 0;
+  const unsigned *const single_use_symbols =
+    ctx->single_use_symbols.data() + ctx->single_use_start[p];
+  const int num_single_use_symbols =
+    ctx->single_use_start[p + 1] - ctx->single_use_start[p];
+  const bool extrasymtab = num_single_use_symbols > 0;
   struct jbig2enc_ctx extrasymtab_ctx;
 
+  // The page's symbols are numbered after those of the global dictionaries and
+  // of its cluster's dictionary, if it has one.
+  const int cluster = p < (int) ctx->page_cluster.size() ? ctx->page_cluster[p] : -1;
+  const int first_id = ctx->num_global_symbols +
+    (cluster >= 0 ? ctx->cluster_nsymbols[cluster] : 0);
+
   struct jbig2_symbol_dict symtab;
   memset(&symtab, 0, sizeof(symtab));
 
+  // Symbols which are in the tables of several pages aren't numbered in the
+  // context, so this page numbers them itself, in a table sorted by template
+  // number for the text region to look them up in.
+  std::vector<std::pair<unsigned, int> > page_symbols;
+  bool shared_symbols = false;
+  for (int i = 0; i < num_single_use_symbols; ++i) {
+    if (ctx->symmap[single_use_symbols[i]] < 0) shared_symbols = true;
+  }
+  if (shared_symbols) {
+    std::vector<unsigned> order;
+    jbig2enc_symbol_order(&ctx->templates, single_use_symbols,
+                          num_single_use_symbols, &order);
+    page_symbols.reserve(num_single_use_symbols);
+    for (int i = 0; i < num_single_use_symbols; ++i) {
+      page_symbols.push_back(std::make_pair(order[i], first_id + i));
+    }
+    std::sort(page_symbols.begin(), page_symbols.end());
+  }
+
   if (extrasymtab) {
-    jbig2enc_init(&extrasymtab_ctx);
-    symseg.number = ctx->segnum++;
+    jbig2enc_init_arena(&extrasymtab_ctx, arena);
+    symseg.number = segnum++;
     symseg.type = segment_symbol_table;
     symseg.page = ctx->pdf_page_numbering ? 1 : 1 + page_no;
     symseg.retain_bits = 1;
 
     jbig2enc_symboltable
-      (&extrasymtab_ctx,
-       ctx->avg_templates ? ctx->avg_templates : ctx->classer->pixat,
-       &ctx->single_use_symbols[page_no], &second_symbol_map,
-       ctx->avg_templates == NULL);
+      (&extrasymtab_ctx, &ctx->templates,
+       single_use_symbols, num_single_use_symbols, NULL, first_id);
     symtab.a1x = 3;
     symtab.a1y = -1;
     symtab.a2x = -3;
@@ -781,43 +1894,44 @@ jbig2_produce_page(struct jbig2ctx *ctx, int page_no,
     symtab.a3y = -2;
     symtab.a4x = -2;
     symtab.a4y = -2;
-    symtab.exsyms = symtab.newsyms =
-      htonl(ctx->single_use_symbols[page_no].size());
+    symtab.exsyms = symtab.newsyms = htonl(num_single_use_symbols);
 
     symseg.len = jbig2enc_datasize(&extrasymtab_ctx) + sizeof(symtab);
   }
 
-  const int numsyms = ctx->num_global_symbols +
-                      ctx->single_use_symbols[page_no].size();
+  const int numsyms = first_id + num_single_use_symbols;
   //BOXA *const boxes = ctx->refinement ? ctx->boxes[page_no] : NULL;
   int baseindex = ctx->refinement ? ctx->baseindexes[page_no] : 0;
-  jbig2enc_textregion(&ectx, ctx->symmap, second_symbol_map,
-                      ctx->pagecomps[page_no],
-                      ctx->classer->ptall,
-                      ctx->avg_templates ? ctx->avg_templates : ctx->classer->pixat,
+  const int first_comp = ctx->page_comps[p];
+  const int numcomps = ctx->page_comps[p + 1] - first_comp;
+  jbig2enc_textregion(&ectx, ctx->symmap,
+                      shared_symbols ? &page_symbols : NULL,
+                      first_comp, numcomps,
+                      ctx->classer->ptall, &ctx->templates,
                       ctx->classer->naclass, 1,
                       log2up(numsyms),
                       //ctx->refinement ? ctx->comps[page_no] : NULL,
                       NULL,
-                      /* boxes */ NULL, baseindex, ctx->refine_level,
-                      ctx->avg_templates == NULL);
+                      /* boxes */ NULL, baseindex, ctx->refine_level);
   const int textdatasize = jbig2enc_datasize(&ectx);
   textreg.width = htonl(ctx->page_width[page_no]);
   textreg.height = htonl(ctx->page_height[page_no]);
   textreg.logsbstrips = 0;
   textreg.sbrefine = ctx->refinement;
   // refcorner = 0 -> bot left
-  textreg_syminsts.sbnuminstances = htonl(ctx->pagecomps[page_no].size());
+  textreg_syminsts.sbnuminstances = htonl(numcomps);
 
   textreg_atflags.a1x = -1;
   textreg_atflags.a1y = -1;
   textreg_atflags.a2x = -1;
   textreg_atflags.a2y = -1;
 
-  segr.number = ctx->segnum;
-  ctx->segnum++;
+  segr.number = segnum;
+  segnum++;
   segr.type = segment_imm_text_region;
-  segr.referred_to.push_back(ctx->symtab_segment);
+  segr.referred_to = std::vector<unsigned>(ctx->symtab_segments.begin(),
+                                           ctx->symtab_segments.end());
+  if (cluster >= 0) segr.referred_to.push_back(ctx->cluster_segnum[cluster]);
   if (extrasymtab) segr.referred_to.push_back(symseg.number);
   if (ctx->refinement) {
     segr.len = sizeof(textreg) + sizeof(textreg_syminsts) +
@@ -833,15 +1947,15 @@ jbig2_produce_page(struct jbig2ctx *ctx, int page_no,
     jbig2enc_datasize(&extrasymtab_ctx) : 0;
 
   if (ctx->full_headers) {
-    endseg.number = ctx->segnum;
-    ctx->segnum++;
+    endseg.number = segnum;
+    segnum++;
     endseg.type = segment_end_of_page;
     endseg.page = ctx->pdf_page_numbering ? 1 : 1 + page_no;
   }
 
   if (include_trailer) {
+    // after the segments of all the pages
     trailerseg.number = ctx->segnum;
-    ctx->segnum++;
     trailerseg.type = segment_end_of_file;
     trailerseg.page = 0;
   }
@@ -889,26 +2003,474 @@ jbig2_produce_page(struct jbig2ctx *ctx, int page_no,
   return ret;
 }
 
-#undef F
-#undef G
+// see comments in .h file
+uint8_t *
+jbig2_produce_page(const struct jbig2ctx *ctx, int page_no,
+                   int xres, int yres, int *const length) {
+  struct jbig2enc_arena *const arena = take_arena(ctx);
+  uint8_t *const ret = produce_page(ctx, page_no, xres, yres, length, arena);
+  put_arena(ctx, arena);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// Produce pages until there are none left which haven't been started. Each
+// call takes the next page from next_page.
+// -----------------------------------------------------------------------------
+static void
+produce_pages(const struct jbig2ctx *ctx, std::atomic<int> *next_page,
+              uint8_t **pages, int *lengths) {
+  const int npages = ctx->classer->npages;
+  // the same memory is used for the coders of every page
+  struct jbig2enc_arena *const arena = take_arena(ctx);
+  for (int p = (*next_page)++; p < npages; p = (*next_page)++) {
+    pages[p] = produce_page(ctx, p, -1, -1, &lengths[p], arena);
+    jbig2enc_arena_reset(arena);
+  }
+  put_arena(ctx, arena);
+}
 
 // see comments in .h file
-u8 *
-jbig2_encode_generic(struct Pix *const bw, const bool full_headers, const int xres,
-                     const int yres, const bool duplicate_line_removal,
-                     int *const length) {
-  int segnum = 0;
+void
+jbig2_produce_all_pages(const struct jbig2ctx *ctx, int nthreads,
+                        uint8_t **pages, int *lengths) {
+  std::atomic<int> next_page(0);
+  std::vector<std::thread> threads;
+  for (int t = 1; t < nthreads && t < ctx->classer->npages; ++t) {
+    threads.push_back(std::thread(produce_pages, ctx, &next_page, pages,
+                                  lengths));
+  }
+  produce_pages(ctx, &next_page, pages, lengths);
+  for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+}
+
+// see comments in .h file
+void
+jbig2_set_window(struct jbig2ctx *ctx, int retire_windows) {
+  if (!ctx->page_width.empty()) {
+    fprintf(stderr, "jbig2_set_window must be called before the first page is "
+                    "added\n");
+    return;
+  }
+  if (!ctx->classifier || !ctx->full_headers || ctx->refinement ||
+      ctx->online_thresh) {
+    fprintf(stderr, "windowed mode needs the native classifier and full "
+                    "headers, and doesn't support refinement or online auto "
+                    "thresholding\n");
+    return;
+  }
+
+  ctx->windowed = true;
+  ctx->retire_windows = retire_windows;
+}
+
+// see comments in .h file
+uint8_t *
+jbig2_flush_window(struct jbig2ctx *ctx, bool last, int *const length) {
+  if (!ctx->windowed) {
+    fprintf(stderr, "jbig2_flush_window needs windowed mode\n");
+    return NULL;
+  }
 
-  if (!bw) return NULL;
-  pixSetPadBits(bw, 0);
+  finish_pending_pages(ctx);
 
+  struct JbClasser *const classer = ctx->classer;
+  const int ntemplates = ctx->classifier->w.size();
+  const int npages = classer->npages - ctx->first_page;
+
+  // The compact store only has the bitmaps of the templates which were created
+  // in this window. It keeps just the sizes of the older templates: those
+  // have been written and are never coded again.
+  std::vector<unsigned> new_templates;
+  for (int t = ctx->first_template; t < ntemplates; ++t) {
+    new_templates.push_back(t);
+    ctx->live_templates.push_back(t);
+  }
+  ctx->template_last_use.resize(ntemplates, ctx->window);
+  ctx->template_dict.resize(ntemplates, ctx->window_dicts.size());
+  ctx->template_dict_index.resize(ntemplates, -1);
+
+  struct jbig2enc_arena *const arena = take_arena(ctx);
+
+  // the new templates go into a symbol dictionary of their own
+  const bool has_dict = !new_templates.empty();
+  struct jbig2enc_ctx dictctx;
+  struct jbig2_symbol_dict symtab;
+  memset(&symtab, 0, sizeof(symtab));
+  Segment dictseg;
+  if (has_dict) {
+    jbig2enc_init_arena(&dictctx, arena);
+    jbig2enc_symboltable(&dictctx, &ctx->templates, new_templates.data(),
+                         new_templates.size(), &ctx->template_dict_index, 0);
+    symtab.a1x = 3;
+    symtab.a1y = -1;
+    symtab.a2x = -3;
+    symtab.a2y = -1;
+    symtab.a3x = 2;
+    symtab.a3y = -2;
+    symtab.a4x = -2;
+    symtab.a4y = -2;
+    symtab.exsyms = symtab.newsyms = htonl(new_templates.size());
+
+    dictseg.number = ctx->segnum++;
+    dictseg.type = segment_symbol_table;
+    dictseg.len = sizeof(symtab) + jbig2enc_datasize(&dictctx);
+    dictseg.page = 0;
+    dictseg.retain_bits = 1;
+
+    struct jbig2_window_dict dict;
+    dict.segnum = dictseg.number;
+    dict.nsymbols = dict.live = new_templates.size();
+    dict.first_symbol = 0;
+    ctx->live_dicts.push_back(ctx->window_dicts.size());
+    ctx->window_dicts.push_back(dict);
+  }
+
+  // The text regions of this window refer to every dictionary which still has
+  // live templates, in the order they were written, and the symbols are
+  // numbered through them in that order.
+  ctx->symtab_segments.clear();
+  int nsymbols = 0;
+  for (size_t i = 0; i < ctx->live_dicts.size(); ++i) {
+    struct jbig2_window_dict &dict = ctx->window_dicts[ctx->live_dicts[i]];
+    dict.first_symbol = nsymbols;
+    nsymbols += dict.nsymbols;
+    ctx->symtab_segments.push_back(dict.segnum);
+  }
+  ctx->num_global_symbols = nsymbols;
+
+  // Number the symbols, pages and segments of the window (there are no per-page
+  // symbol tables) and find the lower-left corners of the components.
+  // jbGetLLCorners can't do that since the classer no longer has the templates.
+  // Only the elements of symmap for the templates used in the window are set,
+  // and they are reset afterwards, so that a window costs time in proportion
+  // to its size rather than to the size of the document.
+  ctx->symmap.resize(ntemplates, -1);
+  ctx->page_comps.assign(npages + 1, 0);
+  ctx->single_use_start.assign(npages + 1, 0);
+  ctx->single_use_symbols.clear();
+  ctx->first_page = classer->npages - npages;
+  ptaDestroy(&classer->ptall);
+  classer->ptall = ptaCreate(classer->naclass->n);
+  for (int i = 0; i < classer->naclass->n; ++i) {
+    int t, page_num, x, y;
+    numaGetIValue(classer->naclass, i, &t);
+    numaGetIValue(classer->napage, i, &page_num);
+    ptaGetIPt(classer->ptaul, i, &x, &y);
+    ptaAddPt(classer->ptall, x, y + ctx->templates.h[t] - 1);
+    ctx->symmap[t] = ctx->window_dicts[ctx->template_dict[t]].first_symbol +
+                     ctx->template_dict_index[t];
+    ctx->template_last_use[t] = ctx->window;
+    ctx->page_comps[page_num - ctx->first_page + 1]++;
+  }
+  ctx->page_segnum.resize(npages);
+  for (int p = 0; p < npages; ++p) {
+    ctx->page_comps[p + 1] += ctx->page_comps[p];
+    // page information, text region, end of page
+    ctx->page_segnum[p] = ctx->segnum;
+    ctx->segnum += 2 + ctx->full_headers;
+  }
+
+  std::vector<uint8_t *> pages(npages);
+  std::vector<int> lengths(npages);
+  struct jbig2enc_arena *const page_arena = take_arena(ctx);
+  for (int p = 0; p < npages; ++p) {
+    pages[p] = produce_page(ctx, ctx->first_page + p, -1, -1, &lengths[p],
+                            page_arena);
+    jbig2enc_arena_reset(page_arena);
+  }
+  put_arena(ctx, page_arena);
+
+  // The number of pages isn't known, so the file header leaves it out.
   struct jbig2_file_header header;
-  if (full_headers) {
-    memset(&header, 0, sizeof(header));
-    header.n_pages = htonl(1);
-    header.organisation_type = 1;
-    memcpy(&header.id, JBIG2_FILE_MAGIC, 8);
+  const int header_size = sizeof(header) - sizeof(header.n_pages);
+  memset(&header, 0, sizeof(header));
+  header.organisation_type = 1;
+  header.unknown_n_pages = 1;
+  memcpy(&header.id, JBIG2_FILE_MAGIC, 8);
+
+  Segment trailerseg;
+  if (last) {
+    trailerseg.number = ctx->segnum++;
+    trailerseg.type = segment_end_of_file;
+    trailerseg.page = 0;
+  }
+
+  int totalsize = (ctx->window == 0 ? header_size : 0) +
+                  (has_dict ? dictseg.size() + dictseg.len : 0) +
+                  (last ? trailerseg.size() : 0);
+  for (int p = 0; p < npages; ++p) totalsize += lengths[p];
+
+  u8 *const ret = (u8 *) malloc(totalsize);
+  int offset = 0;
+  if (ctx->window == 0) {
+    G(&header, header_size);
+  }
+  if (has_dict) {
+    SEGMENT(dictseg);
+    F(symtab);
+    jbig2enc_tobuffer(&dictctx, ret + offset);
+    offset += jbig2enc_datasize(&dictctx);
+    jbig2enc_dealloc(&dictctx);
+  }
+  put_arena(ctx, arena);
+  for (int p = 0; p < npages; ++p) {
+    G(pages[p], lengths[p]);
+    free(pages[p]);
+  }
+  if (last) {
+    SEGMENT(trailerseg);
+  }
+  if (totalsize != offset) abort();
+
+  for (int i = 0; i < classer->naclass->n; ++i) {
+    int t;
+    numaGetIValue(classer->naclass, i, &t);
+    ctx->symmap[t] = -1;
+  }
+
+  // Retire the templates which haven't been used for retire_windows windows,
+  // so that new components aren't compared against them. A dictionary is no
+  // longer referred to once all its templates have been retired.
+  if (ctx->retire_windows > 0) {
+    std::vector<int> live;
+    for (size_t i = 0; i < ctx->live_templates.size(); ++i) {
+      const int t = ctx->live_templates[i];
+      if (ctx->window - ctx->template_last_use[t] < ctx->retire_windows) {
+        live.push_back(t);
+      } else {
+        jbig2classifier_retire(ctx->classifier, t);
+        ctx->window_dicts[ctx->template_dict[t]].live--;
+      }
+    }
+    ctx->live_templates.swap(live);
+
+    std::vector<int> live_dicts;
+    for (size_t i = 0; i < ctx->live_dicts.size(); ++i) {
+      if (ctx->window_dicts[ctx->live_dicts[i]].live) {
+        live_dicts.push_back(ctx->live_dicts[i]);
+      }
+    }
+    ctx->live_dicts.swap(live_dicts);
+  }
+
+  // Everything about the components and templates of this window has been
+  // written.
+  ctx->templates.bits.clear();
+  numaDestroy(&classer->naclass);
+  classer->naclass = numaCreate(0);
+  numaDestroy(&classer->napage);
+  classer->napage = numaCreate(0);
+  ptaDestroy(&classer->ptaul);
+  classer->ptaul = ptaCreate(0);
+  ptaDestroy(&classer->ptall);
+  ctx->first_page = classer->npages;
+  ctx->first_template = ntemplates;
+  ctx->window++;
+
+  *length = offset;
+  return ret;
+}
+
+// see comments in .h file
+void
+jbig2_stream_after_sample(struct jbig2ctx *ctx, bool enable) {
+  if (enable && (!ctx->classifier || ctx->refinement || ctx->windowed ||
+                 ctx->online_thresh)) {
+    fprintf(stderr, "jbig2_stream_after_sample needs the native classifier, "
+                    "and doesn't support refinement, windowed mode or online "
+                    "auto thresholding\n");
+    return;
+  }
+
+  ctx->stream_after_sample = enable;
+}
+
+// -----------------------------------------------------------------------------
+// Encode a page which has been added after the sample (see
+// jbig2_stream_after_sample) and then forget it.
+//
+// The templates which the page created are its own: they go in its symbol
+// table and are dropped afterwards, along with its components, so that the
+// context is back to how jbig2_pages_complete left it.
+// -----------------------------------------------------------------------------
+static uint8_t *
+produce_streamed_page(struct jbig2ctx *ctx, int *const length) {
+  struct JbClasser *const classer = ctx->classer;
+  const int page_no = classer->npages - 1;
+  const int ntemplates = ctx->classifier->w.size();
+
+  std::vector<unsigned> new_templates;
+  for (int t = ctx->sample_templates; t < ntemplates; ++t) {
+    new_templates.push_back(t);
+  }
+  std::vector<unsigned> order;
+  jbig2enc_symbol_order(&ctx->templates, new_templates.data(),
+                        new_templates.size(), &order);
+  ctx->symmap.resize(ntemplates, -1);
+  for (size_t i = 0; i < order.size(); ++i) {
+    ctx->symmap[order[i]] = ctx->num_global_symbols + i;
+  }
+  ctx->single_use_symbols.insert(ctx->single_use_symbols.end(),
+                                 new_templates.begin(), new_templates.end());
+
+  // The components of this page follow those of the sample. The per-page
+  // arrays grow by an element for each page.
+  ctx->page_comps.resize(page_no + 2);
+  ctx->page_comps[page_no] = ctx->sample_comps;
+  ctx->page_comps[page_no + 1] = classer->naclass->n;
+  ctx->single_use_start.resize(page_no + 2);
+  ctx->single_use_start[page_no] = ctx->sample_single_use;
+  ctx->single_use_start[page_no + 1] = ctx->single_use_symbols.size();
+  ctx->page_segnum.resize(page_no + 1);
+  ctx->page_segnum[page_no] = ctx->segnum;
+  ctx->segnum += 2 + !new_templates.empty() + ctx->full_headers;
+
+  // jbGetLLCorners can't be used since the classer no longer has the
+  // templates
+  for (int i = ctx->sample_comps; i < classer->naclass->n; ++i) {
+    int t, x, y;
+    numaGetIValue(classer->naclass, i, &t);
+    ptaGetIPt(classer->ptaul, i, &x, &y);
+    ptaAddPt(classer->ptall, x, y + ctx->templates.h[t] - 1);
+  }
+
+  struct jbig2enc_arena *const arena = take_arena(ctx);
+  uint8_t *const ret = produce_page(ctx, page_no, -1, -1, length, arena);
+  put_arena(ctx, arena);
+
+  jbig2classifier_truncate(ctx->classifier, ctx->sample_templates);
+  jbig2enc_templates_truncate(&ctx->templates, ctx->sample_templates);
+  ctx->symmap.resize(ctx->sample_templates);
+  ctx->single_use_symbols.resize(ctx->sample_single_use);
+  classer->nclass = ctx->sample_templates;
+  classer->naclass->n = ctx->sample_comps;
+  classer->napage->n = ctx->sample_comps;
+  classer->ptaul->n = ctx->sample_comps;
+  classer->ptall->n = ctx->sample_comps;
+
+  return ret;
+}
+
+// see comments in .h file
+uint8_t *
+jbig2_stream_page(struct jbig2ctx *ctx, struct Pix *bw, int *const length) {
+  if (ctx->windowed) {
+    jbig2_add_page(ctx, bw);
+    return jbig2_flush_window(ctx, false, length);
+  }
+
+  if (!ctx->stream_after_sample || ctx->sample_pages < 0) {
+    fprintf(stderr, "jbig2_stream_page needs windowed mode, or "
+                    "jbig2_stream_after_sample and jbig2_pages_complete\n");
+    return NULL;
+  }
+
+  jbig2_add_page(ctx, bw);
+  finish_pending_pages(ctx);
+  return produce_streamed_page(ctx, length);
+}
+
+// see comments in .h file
+uint8_t *
+jbig2_stream_trailer(struct jbig2ctx *ctx, int *const length) {
+  *length = 0;
+  if (!ctx->full_headers) return NULL;
+
+  Segment trailerseg;
+  trailerseg.number = ctx->segnum++;
+  trailerseg.type = segment_end_of_file;
+  trailerseg.page = 0;
+  u8 *const ret = (u8 *) malloc(trailerseg.size());
+  int offset = 0;
+  SEGMENT(trailerseg);
+  *length = offset;
+  return ret;
+}
+
+#undef F
+#undef G
+
+// -----------------------------------------------------------------------------
+// An image to encode as a generic region: a Pix or the caller's packed rows
+// (see jbig2_encode_generic_raw)
+// -----------------------------------------------------------------------------
+struct generic_image {
+  struct Pix *pix;  // if NULL, the image is the following
+  const u8 *data;
+  int width, height, stride;
+  enum jbig2_bit_order order;
+  int xres, yres;
+};
+
+static struct generic_image
+pix_generic_image(struct Pix *const bw) {
+  struct generic_image image;
+  memset(&image, 0, sizeof(image));
+  image.pix = bw;
+  if (bw) {
+    image.width = bw->w;
+    image.height = bw->h;
+    image.xres = bw->xres;
+    image.yres = bw->yres;
+  }
+  return image;
+}
+
+static struct generic_image
+raw_generic_image(const u8 *const data, const int width, const int height,
+                  const int stride, const enum jbig2_bit_order order) {
+  struct generic_image image;
+  memset(&image, 0, sizeof(image));
+  image.data = data;
+  image.width = width;
+  image.height = height;
+  image.stride = stride;
+  image.order = order;
+  return image;
+}
+
+// -----------------------------------------------------------------------------
+// Fill in the region segment information of a generic region coded with the
+// fixed template used by jbig2enc_bitimage
+// -----------------------------------------------------------------------------
+static void
+init_generic_region(struct jbig2_generic_region *genreg, const int width,
+                    const int height, const bool duplicate_line_removal) {
+  memset(genreg, 0, sizeof(*genreg));
+  genreg->width = htonl(width);
+  genreg->height = htonl(height);
+  if (duplicate_line_removal) {
+    genreg->tpgdon = true;
   }
+  genreg->a1x = 3;
+  genreg->a1y = -1;
+  genreg->a2x = -3;
+  genreg->a2y = -1;
+  genreg->a3x = 2;
+  genreg->a3y = -2;
+  genreg->a4x = -2;
+  genreg->a4y = -2;
+}
+
+// -----------------------------------------------------------------------------
+// Encode a page as a generic region (see jbig2_encode_generic_page). With
+// full headers, the file header is written first if header is not NULL, and
+// the end of file segment last if trailer is true.
+// -----------------------------------------------------------------------------
+static u8 *
+encode_generic(const struct generic_image &image, const bool full_headers,
+               const int page_no, const int xres, const int yres,
+               const bool duplicate_line_removal,
+               const struct jbig2_file_header *header, const bool trailer,
+               int *const length) {
+  // with full headers each page has three segments, otherwise every page is
+  // page 1 on its own
+  int segnum = full_headers ? 3 * page_no : 0;
+  const int page = full_headers ? page_no + 1 : 1;
+
+  if (!image.pix && !image.data) return NULL;
+  if (image.pix) pixSetPadBits(image.pix, 0);
 
   // setup compression
   struct jbig2enc_ctx ctx;
@@ -918,60 +2480,58 @@ jbig2_encode_generic(struct Pix *const bw, const bool full_headers, const int xr
   jbig2_page_info pageinfo;
   memset(&pageinfo, 0, sizeof(pageinfo));
   jbig2_generic_region genreg;
-  memset(&genreg, 0, sizeof(genreg));
 
   seg.number = segnum;
   segnum++;
   seg.type = segment_page_information;
-  seg.page = 1;
+  seg.page = page;
   seg.len = sizeof(struct jbig2_page_info);
-  pageinfo.width = htonl(bw->w);
-  pageinfo.height = htonl(bw->h);
-  pageinfo.xres = htonl(xres ? xres : bw->xres);
-  pageinfo.yres = htonl(yres ? yres : bw->yres);
+  pageinfo.width = htonl(image.width);
+  pageinfo.height = htonl(image.height);
+  pageinfo.xres = htonl(xres ? xres : image.xres);
+  pageinfo.yres = htonl(yres ? yres : image.yres);
   pageinfo.is_lossless = 1;
 
 #ifdef SURPRISE_MAP
-  dprintf(3, "P5\n%d %d 255\n", bw->w, bw->h);
+  dprintf(3, "P5\n%d %d 255\n", image.width, image.height);
 #endif
 
-  jbig2enc_bitimage(&ctx, (u8 *) bw->data, bw->w, bw->h, duplicate_line_removal);
+  if (image.pix) {
+    jbig2enc_bitimage(&ctx, (u8 *) image.pix->data, image.width, image.height,
+                      duplicate_line_removal);
+  } else {
+    jbig2enc_rawimage(&ctx, image.data, image.stride, image.width, image.height,
+                      image.order == JBIG2_LSB_FIRST, duplicate_line_removal);
+  }
   jbig2enc_final(&ctx);
   const int datasize = jbig2enc_datasize(&ctx);
 
   seg2.number = segnum;
   segnum++;
   seg2.type = segment_imm_generic_region;
-  seg2.page = 1;
+  seg2.page = page;
   seg2.len = sizeof(genreg) + datasize;
 
   endseg.number = segnum;
   segnum++;
-  endseg.page = 1;
+  endseg.page = page;
 
-  genreg.width = htonl(bw->w);
-  genreg.height = htonl(bw->h);
-  if (duplicate_line_removal) {
-    genreg.tpgdon = true;
-  }
-  genreg.a1x = 3;
-  genreg.a1y = -1;
-  genreg.a2x = -3;
-  genreg.a2y = -1;
-  genreg.a3x = 2;
-  genreg.a3y = -2;
-  genreg.a4x = -2;
-  genreg.a4y = -2;
+  init_generic_region(&genreg, image.width, image.height,
+                      duplicate_line_removal);
 
+  const bool write_header = full_headers && header;
+  const bool write_trailer = full_headers && trailer;
   const int totalsize = seg.size() + sizeof(pageinfo) + seg2.size() +
                         sizeof(genreg) + datasize +
-                        (full_headers ? (sizeof(header) + 2*endseg.size()) : 0);
+                        (write_header ? sizeof(*header) : 0) +
+                        (full_headers ? endseg.size() : 0) +
+                        (write_trailer ? endseg.size() : 0);
   u8 *const ret = (u8 *) malloc(totalsize);
   int offset = 0;
 
 #define F(x) memcpy(ret + offset, &x, sizeof(x)) ; offset += sizeof(x)
-  if (full_headers) {
-    F(header);
+  if (write_header) {
+    F(*header);
   }
   SEGMENT(seg);
   F(pageinfo);
@@ -983,6 +2543,8 @@ jbig2_encode_generic(struct Pix *const bw, const bool full_headers, const int xr
   if (full_headers) {
     endseg.type = segment_end_of_page;
     SEGMENT(endseg);
+  }
+  if (write_trailer) {
     endseg.number += 1;
     endseg.page = 0;
     endseg.type = segment_end_of_file;
@@ -997,3 +2559,259 @@ jbig2_encode_generic(struct Pix *const bw, const bool full_headers, const int xr
 
   return ret;
 }
+
+// -----------------------------------------------------------------------------
+// Encode a single page file (see jbig2_encode_generic)
+// -----------------------------------------------------------------------------
+static u8 *
+encode_generic_file(const struct generic_image &image, const bool full_headers,
+                    const int xres, const int yres,
+                    const bool duplicate_line_removal, int *const length) {
+  struct jbig2_file_header header;
+  memset(&header, 0, sizeof(header));
+  header.n_pages = htonl(1);
+  header.organisation_type = 1;
+  memcpy(&header.id, JBIG2_FILE_MAGIC, 8);
+
+  return encode_generic(image, full_headers, 0, xres, yres,
+                        duplicate_line_removal, &header, true, length);
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic(struct Pix *const bw, const bool full_headers, const int xres,
+                     const int yres, const bool duplicate_line_removal,
+                     int *const length) {
+  return encode_generic_file(pix_generic_image(bw), full_headers, xres, yres,
+                             duplicate_line_removal, length);
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_raw(const u8 *const data, const int width,
+                         const int height, const int stride,
+                         const enum jbig2_bit_order order,
+                         const bool full_headers, const int xres,
+                         const int yres, const bool duplicate_line_removal,
+                         int *const length) {
+  return encode_generic_file(raw_generic_image(data, width, height, stride,
+                                               order),
+                             full_headers, xres, yres, duplicate_line_removal,
+                             length);
+}
+
+// see comments in .h file
+u8 *
+jbig2_generic_header(const int npages, int *const length) {
+  struct jbig2_file_header header;
+  memset(&header, 0, sizeof(header));
+  header.n_pages = htonl(npages);
+  header.organisation_type = 1;
+  header.unknown_n_pages = npages < 0;
+  memcpy(&header.id, JBIG2_FILE_MAGIC, 8);
+
+  // the number of pages is left out if it's unknown
+  const int header_size = npages < 0 ?
+    sizeof(header) - sizeof(header.n_pages) : sizeof(header);
+  u8 *const ret = (u8 *) malloc(header_size);
+  memcpy(ret, &header, header_size);
+  *length = header_size;
+  return ret;
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_page(struct Pix *const bw, const bool full_headers,
+                          const int page_no, const int xres, const int yres,
+                          const bool duplicate_line_removal, int *const length) {
+  return encode_generic(pix_generic_image(bw), full_headers, page_no, xres,
+                        yres, duplicate_line_removal, NULL, false, length);
+}
+
+// see comments in .h file
+u8 *
+jbig2_encode_generic_raw_page(const u8 *const data, const int width,
+                              const int height, const int stride,
+                              const enum jbig2_bit_order order,
+                              const bool full_headers, const int page_no,
+                              const int xres, const int yres,
+                              const bool duplicate_line_removal,
+                              int *const length) {
+  return encode_generic(raw_generic_image(data, width, height, stride, order),
+                        full_headers, page_no, xres, yres,
+                        duplicate_line_removal, NULL, false, length);
+}
+
+// see comments in .h file
+u8 *
+jbig2_generic_trailer(const int npages, int *const length) {
+  Segment seg;
+  seg.number = 3 * npages;
+  seg.type = segment_end_of_file;
+
+  u8 *const ret = (u8 *) malloc(seg.size());
+  int offset = 0;
+  SEGMENT(seg);
+  *length = offset;
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+// A page being encoded as a generic region as its rows arrive
+// -----------------------------------------------------------------------------
+struct jbig2_generic_stream {
+  struct jbig2enc_ctx ctx;
+  int width, height;
+  int rows;  // the number of rows encoded so far
+  enum jbig2_bit_order order;
+  bool full_headers;
+  bool duplicate_line_removal;
+  int segnum;  // the number of the generic region segment
+  int page;
+  u8 ltp;  // the TPGD state (see jbig2enc_rawimage_row)
+  jbig2_sink sink;
+  void *arg;
+  bool failed;  // true once the sink has failed
+  // copies of the last two rows, since the caller's buffer may be reused
+  std::vector<u8> last_rows[2];
+};
+
+static void
+stream_write(struct jbig2_generic_stream *stream, const u8 *data, size_t length) {
+  if (!stream->failed && !stream->sink(stream->arg, data, length)) {
+    stream->failed = true;
+  }
+}
+
+// see comments in .h file
+struct jbig2_generic_stream *
+jbig2_generic_begin_page(const int width, const int height, const int xres,
+                         const int yres, const bool full_headers,
+                         const int page_no, const bool duplicate_line_removal,
+                         const enum jbig2_bit_order order, jbig2_sink sink,
+                         void *arg) {
+  struct jbig2_generic_stream *const stream = new jbig2_generic_stream;
+  jbig2enc_init(&stream->ctx);
+  stream->width = width;
+  stream->height = height;
+  stream->rows = 0;
+  stream->order = order;
+  stream->full_headers = full_headers;
+  stream->duplicate_line_removal = duplicate_line_removal;
+  // numbered as by jbig2_encode_generic_page
+  stream->segnum = full_headers ? 3 * page_no + 1 : 1;
+  stream->page = full_headers ? page_no + 1 : 1;
+  stream->ltp = 0;
+  stream->sink = sink;
+  stream->arg = arg;
+  stream->failed = false;
+  stream->last_rows[0].resize((width + 7) / 8);
+  stream->last_rows[1].resize((width + 7) / 8);
+
+  Segment seg, seg2;
+  seg.number = stream->segnum - 1;
+  seg.type = segment_page_information;
+  seg.page = stream->page;
+  seg.len = sizeof(struct jbig2_page_info);
+  jbig2_page_info pageinfo;
+  memset(&pageinfo, 0, sizeof(pageinfo));
+  pageinfo.width = htonl(width);
+  pageinfo.height = htonl(height);
+  pageinfo.xres = htonl(xres);
+  pageinfo.yres = htonl(yres);
+  pageinfo.is_lossless = 1;
+
+  // The length of the region isn't known until the last row, so it's given as
+  // unknown and the data is followed by the number of rows. (7.2.7)
+  seg2.number = stream->segnum;
+  seg2.type = segment_imm_generic_region;
+  seg2.page = stream->page;
+  seg2.len = 0xffffffff;
+  jbig2_generic_region genreg;
+  init_generic_region(&genreg, width, height, duplicate_line_removal);
+
+  std::vector<u8> headers(seg.size() + sizeof(pageinfo) + seg2.size() +
+                          sizeof(genreg));
+  u8 *const ret = headers.data();
+  int offset = 0;
+  SEGMENT(seg);
+  F(pageinfo);
+  SEGMENT(seg2);
+  F(genreg);
+  stream_write(stream, ret, offset);
+
+  return stream;
+}
+
+// see comments in .h file
+bool
+jbig2_generic_push_rows(struct jbig2_generic_stream *stream, const u8 *data,
+                        const int nrows, const int stride) {
+  if (nrows < 0 || stream->rows + nrows > stream->height) {
+    fprintf(stderr, "jbig2_generic_push_rows: more rows than the page has\n");
+    return false;
+  }
+
+  const bool lsb_first = stream->order == JBIG2_LSB_FIRST;
+  const u8 *const older = stream->last_rows[0].data();
+  const u8 *const last = stream->last_rows[1].data();
+  for (int i = 0; i < nrows; ++i) {
+    const u8 *const row = data + (size_t) i * stride;
+    const u8 *const row1 = i >= 1 ? row - stride : last;
+    const u8 *const row2 = i >= 2 ? row - 2 * stride : i == 1 ? last : older;
+    jbig2enc_rawimage_row(&stream->ctx, row2, row1, row, stream->width,
+                          stream->rows++, lsb_first,
+                          stream->duplicate_line_removal, &stream->ltp);
+  }
+
+  const size_t row_bytes = stream->last_rows[0].size();
+  if (nrows >= 2) {
+    memcpy(stream->last_rows[0].data(), data + (size_t) (nrows - 2) * stride,
+           row_bytes);
+  } else if (nrows == 1) {
+    stream->last_rows[0].swap(stream->last_rows[1]);
+  }
+  if (nrows >= 1) {
+    memcpy(stream->last_rows[1].data(), data + (size_t) (nrows - 1) * stride,
+           row_bytes);
+  }
+
+  if (!stream->failed &&
+      !jbig2enc_drain(&stream->ctx, stream->sink, stream->arg)) {
+    stream->failed = true;
+  }
+  return !stream->failed;
+}
+
+// see comments in .h file
+bool
+jbig2_generic_end_page(struct jbig2_generic_stream *stream) {
+  jbig2enc_final(&stream->ctx);
+  if (!stream->failed &&
+      !jbig2enc_drain(&stream->ctx, stream->sink, stream->arg)) {
+    stream->failed = true;
+  }
+
+  // the rest of the coded data, which ends with 0xffac, then the row count
+  Segment endseg;
+  endseg.number = stream->segnum + 1;
+  endseg.type = segment_end_of_page;
+  endseg.page = stream->page;
+  const u32 rows = htonl(stream->rows);
+  std::vector<u8> trailer(jbig2enc_datasize(&stream->ctx) + sizeof(rows) +
+                          (stream->full_headers ? endseg.size() : 0));
+  u8 *const ret = trailer.data();
+  int offset = 0;
+  jbig2enc_tobuffer(&stream->ctx, ret);
+  offset += jbig2enc_datasize(&stream->ctx);
+  F(rows);
+  if (stream->full_headers) {
+    SEGMENT(endseg);
+  }
+  stream_write(stream, ret, offset);
+
+  const bool ok = !stream->failed;
+  jbig2enc_dealloc(&stream->ctx);
+  delete stream;
+  return ok;
+}
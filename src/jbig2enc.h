@@ -39,6 +39,7 @@
 #else
 #include <stdint.h>
 #endif
+#include <stddef.h>
 
 // -----------------------------------------------------------------------------
 // Returns the version identifier as a static string.
@@ -62,8 +63,10 @@ struct jbig2ctx;
 // Then call jbig2_pages_complete. This returns a malloced buffer with the
 // symbol table encoded.
 //
-// Then call jbig2_produce_page for each page. You must call it with pages
-// numbered from zero, and for every page.
+// Then call jbig2_produce_page for each page (or jbig2_produce_all_pages). You
+// must call it with pages numbered from zero, and for every page. The pages
+// may be produced in any order, and on several threads at once, but must be
+// output in order.
 // -----------------------------------------------------------------------------
 
 // -----------------------------------------------------------------------------
@@ -94,8 +97,145 @@ void jbig2_destroy(struct jbig2ctx *);
 // bw: A 1-bpp image
 // -----------------------------------------------------------------------------
 void jbig2_add_page(struct jbig2ctx *ctx, struct Pix *bw);
+
+// -----------------------------------------------------------------------------
+// The order of the pixels in each byte of an image given as packed 1 bpp rows,
+// rather than as a Pix. A set bit is a black pixel in either case.
+// -----------------------------------------------------------------------------
+enum jbig2_bit_order {
+  JBIG2_MSB_FIRST,  // the first pixel is the top bit (PBM, TIFF FillOrder 1)
+  JBIG2_LSB_FIRST,  // the first pixel is the bottom bit (TIFF FillOrder 2)
+};
+
+// -----------------------------------------------------------------------------
+// Like jbig2_add_page, for a page which is height rows of width pixels, each
+// stride bytes after the last. The bits past width in the last byte of a row
+// may be anything.
+//
+// xres, yres: the resolution of the page
+// -----------------------------------------------------------------------------
+void jbig2_add_page_raw(struct jbig2ctx *ctx, const uint8_t *data, int width,
+                        int height, int stride, enum jbig2_bit_order order,
+                        int xres, int yres);
+// -----------------------------------------------------------------------------
+// Classify the components of each page with the encoder's own correlation
+// classifier rather than Leptonica's. It follows the same steps (see
+// jbig2classifier.h), with the bitmaps compared a machine word at a time,
+// which is much faster on documents with many symbols. The symbols are also
+// kept without Leptonica's PIX structures and borders as they are found, which
+// takes much less memory, unless refinement or auto thresholding is used. Auto
+// thresholding (jbig2enc_auto_threshold and friends, and -a and
+// --online-auto-thresh on the command line) compares the templates as
+// Leptonica PIXs, so they are moved back into bordered PIXs and it gets none
+// of the saving.
+//
+// Call this before the first jbig2_add_page.
+// -----------------------------------------------------------------------------
+void jbig2_use_native_classifier(struct jbig2ctx *ctx, bool enable);
+// -----------------------------------------------------------------------------
+// Classify the components of each page among themselves first, and then match
+// only one representative of each of these local classes against the symbols
+// of the whole document. The other components of a local class take the
+// symbol of its representative. This saves most of the comparisons against the
+// (growing) document-wide symbol set, and the local step runs on the ingest
+// threads (see jbig2_set_ingest_threads). The result can differ slightly from
+// classifying every component directly since matching is not transitive.
+//
+// Needs jbig2_use_native_classifier.
+// -----------------------------------------------------------------------------
+void jbig2_use_local_classes(struct jbig2ctx *ctx, bool enable);
+
+// -----------------------------------------------------------------------------
+// A check of the native classifier against Leptonica's. Every page given to
+// jbig2_classifier_check_add_page is classified by both (each with its own
+// set of templates, built up over the pages) and the results are compared.
+// -----------------------------------------------------------------------------
+struct jbig2_classifier_check;
+
+struct jbig2_classifier_comparison {
+  int pages, components;
+  // the number of templates each classifier created
+  int leptonica_templates, native_templates;
+  // the components which the native classifier doesn't put in a class with the
+  // same components as Leptonica's does
+  int different_class;
+  // of the others, the components which are placed differently, and the
+  // largest difference in either direction, in pixels
+  int different_place;
+  int max_offset;
+  // the time spent classifying, in seconds
+  double leptonica_seconds, native_seconds;
+};
+
+// thresh, weight: see jbig2_init
+struct jbig2_classifier_check *jbig2_classifier_check_init(float thresh,
+                                                           float weight);
+void jbig2_classifier_check_add_page(struct jbig2_classifier_check *check,
+                                     struct Pix *bw);
+void jbig2_classifier_check_result(const struct jbig2_classifier_check *check,
+                                   struct jbig2_classifier_comparison *result);
+void jbig2_classifier_check_destroy(struct jbig2_classifier_check *check);
+// -----------------------------------------------------------------------------
+// Pipeline jbig2_add_page over nthreads threads. The components of each new
+// page are extracted on a worker thread while the earlier pages are classified
+// on the caller's thread, in the order they were added, so the output is the
+// same as with one thread. Up to nthreads pages are held in flight.
+//
+// This only has an effect with jbig2_use_native_classifier since Leptonica
+// extracts and classifies in one step.
+// -----------------------------------------------------------------------------
+void jbig2_set_ingest_threads(struct jbig2ctx *ctx, int nthreads);
+// -----------------------------------------------------------------------------
+// Split the global symbol dictionary into (up to) ndicts symbol table segments,
+// which jbig2_pages_complete encodes in parallel. Each segment holds whole
+// height classes and the text regions of every page refer to all of them. Call
+// this before jbig2_pages_complete. (default: 1)
+// -----------------------------------------------------------------------------
+void jbig2_split_global_dictionary(struct jbig2ctx *ctx, int ndicts);
+// -----------------------------------------------------------------------------
+// Some PDF readers decode the global symbol dictionary for every page, so a
+// large global dictionary slows down the rendering of every page. When
+// deciding whether a symbol goes in the global dictionary or in the symbol
+// tables of the pages which use it, jbig2_pages_complete weighs the size of
+// the output against the number of dictionary pixels decoded per page: weight
+// is the number of bytes of output which saving one decoded pixel is worth.
+//
+// With a weight of 0 (the default) the output is as small as possible: symbols
+// used on more than one page are global and the rest are in their page's
+// table. Call this before jbig2_pages_complete.
+// -----------------------------------------------------------------------------
+void jbig2_set_decode_cost_weight(struct jbig2ctx *ctx, float weight);
+// -----------------------------------------------------------------------------
+// Build the global symbol dictionary from a sample of the document and then
+// stream the rest of the pages against it. With this set, add the first few
+// pages, call jbig2_pages_complete (which encodes the global dictionary from
+// them) and produce those pages as usual. Then pass each of the remaining
+// pages to jbig2_stream_page, which writes it out straight away. Only the
+// state of the sample is kept, so memory use doesn't grow with the length of
+// the document.
+//
+// A full JBIG2 file leaves the number of pages unknown and is ended by
+// jbig2_stream_trailer. Needs
+// jbig2_use_native_classifier; refinement, windowed mode and auto
+// thresholding aren't supported. Call this before jbig2_pages_complete.
+// -----------------------------------------------------------------------------
+void jbig2_stream_after_sample(struct jbig2ctx *ctx, bool enable);
+// -----------------------------------------------------------------------------
+// Documents often have sections which use symbols that the rest of the
+// document doesn't (a different font, say). With nclusters > 1,
+// jbig2_pages_complete groups the pages into (up to) nclusters clusters of
+// pages which use the same symbols. A symbol which would be global but is only
+// used by the pages of one cluster goes in a dictionary for that cluster, and
+// the text region of each page refers to the global dictionaries and to its
+// cluster's. So a page only decodes the symbols which are shared across the
+// document and those of its own section.
+//
+// Not supported with jbig2_stream_after_sample. Call this before
+// jbig2_pages_complete. (default: 1, no clusters)
+// -----------------------------------------------------------------------------
+void jbig2_set_page_clusters(struct jbig2ctx *ctx, int nclusters);
 // -----------------------------------------------------------------------------
-// Finalise information about the document and encode the symbol table.
+// Finalise information about the document and encode the symbol table(s).
 //
 // WARNING: returns a malloced buffer which the caller must free
 // -----------------------------------------------------------------------------
@@ -111,9 +251,117 @@ uint8_t *jbig2_pages_complete(struct jbig2ctx *ctx, int *const length,
 //
 // WARNING: returns a malloced buffer which the caller must free
 // -----------------------------------------------------------------------------
-uint8_t *jbig2_produce_page(struct jbig2ctx *ctx, int page_no, int xres,
+uint8_t *jbig2_produce_page(const struct jbig2ctx *ctx, int page_no, int xres,
                             int yres, int *const length);
 
+// -----------------------------------------------------------------------------
+// Encode every page, using nthreads threads. This is the same as calling
+// jbig2_produce_page(ctx, page_no, -1, -1, &lengths[page_no]) for each page
+// and storing the result in pages[page_no].
+//
+// jbig2_produce_page doesn't change the context, so it may also be called for
+// different pages from different threads directly.
+//
+// pages, lengths: arrays with an element for each page
+//
+// WARNING: each element of pages is a malloced buffer which the caller must
+// free
+// -----------------------------------------------------------------------------
+void jbig2_produce_all_pages(const struct jbig2ctx *ctx, int nthreads,
+                             uint8_t **pages, int *lengths);
+
+// -----------------------------------------------------------------------------
+// Page clusters (see jbig2_set_page_clusters), after jbig2_pages_complete.
+//
+// jbig2_page_clusters returns the number of clusters, which is 0 if the pages
+// weren't clustered, and jbig2_page_cluster the cluster of a page (or -1).
+//
+// With full_headers, the dictionaries of the clusters are in the output of
+// jbig2_pages_complete. Otherwise, that only has the global dictionaries and
+// jbig2_cluster_symbols returns the dictionary of a cluster. In a PDF, the
+// globals of a page are then the global dictionaries followed by the
+// dictionary of the page's cluster.
+//
+// WARNING: jbig2_cluster_symbols returns a malloced buffer which the caller
+// must free
+// -----------------------------------------------------------------------------
+int jbig2_page_clusters(const struct jbig2ctx *ctx);
+int jbig2_page_cluster(const struct jbig2ctx *ctx, int page_no);
+uint8_t *jbig2_cluster_symbols(const struct jbig2ctx *ctx, int cluster,
+                               int *const length);
+
+// -----------------------------------------------------------------------------
+// Windowed compression.
+//
+// Normally nothing can be written until every page has been added, and
+// everything about every page is kept until then. In windowed mode the pages
+// are written a window at a time instead: each window gets a symbol
+// dictionary holding the templates which were first seen in it, followed by
+// the text regions of its pages. The output is a full JBIG2 file (in the
+// sequential organisation, with the number of pages left unknown), so this
+// needs full_headers, and it needs jbig2_use_native_classifier. Refinement and
+// online auto thresholding aren't supported.
+//
+// Templates which haven't been used for retire_windows windows are retired:
+// later components are no longer compared against them and their bitmaps are
+// freed. Once all the templates of a dictionary are retired, text regions stop
+// referring to it. If retire_windows is 0, templates are never retired.
+//
+// Call jbig2_set_window before the first jbig2_add_page, then call
+// jbig2_flush_window to write out the pages added since the last call: every
+// so many pages, say, or when memory use grows too large. Do not call
+// jbig2_pages_complete or jbig2_produce_page.
+// -----------------------------------------------------------------------------
+void jbig2_set_window(struct jbig2ctx *ctx, int retire_windows);
+
+// -----------------------------------------------------------------------------
+// Write the window of pages added since the last call (or since the start).
+// The output of the successive calls, concatenated, is the JBIG2 file.
+//
+// last: if true, this is the last window and the file is ended. No more pages
+//       may be added.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *jbig2_flush_window(struct jbig2ctx *ctx, bool last,
+                            int *const length);
+
+// -----------------------------------------------------------------------------
+// Streaming: add a page and write it out straight away. This gets each page
+// out as soon as it's added, at some cost in compression, so it suits
+// interactive use where the number of pages isn't known up front. There are
+// two ways of doing it:
+//
+// In windowed mode (see jbig2_set_window) the page is a window of its own.
+// Its new symbols go in a dictionary just for it and its text region refers to
+// that and to the earlier dictionaries which are still live. Use a
+// retire_windows of no more than a few hundred pages: with 0, no dictionary is
+// ever dropped, so the list each page refers to (and the width of its symbol
+// IDs) grows with every page. After the last page, call jbig2_flush_window(ctx, true, ...) to end
+// the file.
+//
+// After a sample (see jbig2_stream_after_sample) the page is classified
+// against the global symbols of the sample, and the symbols which it doesn't
+// find there go in the page's own symbol table. The page is then forgotten.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *jbig2_stream_page(struct jbig2ctx *ctx, struct Pix *bw,
+                           int *const length);
+
+// -----------------------------------------------------------------------------
+// End a full JBIG2 file whose pages were streamed after a sample: returns the
+// end of file segment. Without full headers there is nothing to write, and
+// this returns NULL with a length of 0.
+//
+// If the document turns out to fit in the sample, call
+// jbig2_stream_after_sample(ctx, false) before jbig2_pages_complete instead,
+// so that the file gives the number of pages and is ended by its last page.
+//
+// WARNING: returns a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *jbig2_stream_trailer(struct jbig2ctx *ctx, int *const length);
+
 // WARNING: returns a malloced buffer which the caller must free
 // -----------------------------------------------------------------------------
 
@@ -140,9 +388,93 @@ jbig2_encode_generic(struct Pix *const bw, const bool full_headers,
                      const bool duplicate_line_removal,
                      int *const length);
 
+// -----------------------------------------------------------------------------
+// Like jbig2_encode_generic, for an image given as packed rows (see
+// jbig2_add_page_raw). The rows are read where they are, without being copied
+// into a Pix, and aren't modified.
+//
+// xres, yres: the resolution of the image. If 0, none is given.
+// -----------------------------------------------------------------------------
+uint8_t *
+jbig2_encode_generic_raw(const uint8_t *data, int width, int height, int stride,
+                         enum jbig2_bit_order order, const bool full_headers,
+                         const int xres, const int yres,
+                         const bool duplicate_line_removal, int *const length);
+
+// -----------------------------------------------------------------------------
+// Multi-page generic region coding.
+//
+// Each page is encoded on its own by jbig2_encode_generic_page, which doesn't
+// share any state, so pages may be encoded on different threads at once. A
+// full JBIG2 file is the output of jbig2_generic_header, then that of each
+// page in order and then that of jbig2_generic_trailer. Without full headers
+// each page is a standalone page 1, as needed for PDF.
+//
+// npages: the number of pages in the file. For jbig2_generic_header, -1 if it
+//         isn't known yet
+// page_no: number of this page, indexed from 0
+//
+// WARNING: these return a malloced buffer which the caller must free
+// -----------------------------------------------------------------------------
+uint8_t *jbig2_generic_header(int npages, int *const length);
+uint8_t *jbig2_encode_generic_page(struct Pix *const bw, const bool full_headers,
+                                   const int page_no, const int xres,
+                                   const int yres,
+                                   const bool duplicate_line_removal,
+                                   int *const length);
+uint8_t *jbig2_encode_generic_raw_page(const uint8_t *data, int width,
+                                       int height, int stride,
+                                       enum jbig2_bit_order order,
+                                       const bool full_headers,
+                                       const int page_no, const int xres,
+                                       const int yres,
+                                       const bool duplicate_line_removal,
+                                       int *const length);
+uint8_t *jbig2_generic_trailer(int npages, int *const length);
+
+// -----------------------------------------------------------------------------
+// Generic region coding of a page as its rows arrive, e.g. from a scanner.
+//
+// jbig2_generic_begin_page starts a page, which is then given a few rows at a
+// time by jbig2_generic_push_rows, and jbig2_generic_end_page finishes it. Only
+// the last two rows are kept between calls, and the coded data is passed to
+// sink as it's produced, so memory use is small and doesn't depend on the
+// height of the page.
+//
+// The output is the same as that of jbig2_encode_generic_page, except that
+// the length of the generic region segment is given as unknown (0xffffffff)
+// and its data is followed by the number of rows coded. (7.2.7) This may be
+// fewer than height, if jbig2_generic_end_page is called early, in which case
+// the rest of the page is white. Not every decoder supports this, and PDF
+// doesn't allow it.
+//
+// The rows are packed as for jbig2_encode_generic_raw, with bits in order.
+// sink returns false if it fails, after which nothing more is passed to it.
+// -----------------------------------------------------------------------------
+typedef bool (*jbig2_sink)(void *arg, const uint8_t *data, size_t length);
+struct jbig2_generic_stream;
+
+struct jbig2_generic_stream *
+jbig2_generic_begin_page(int width, int height, int xres, int yres,
+                         const bool full_headers, int page_no,
+                         const bool duplicate_line_removal,
+                         enum jbig2_bit_order order, jbig2_sink sink,
+                         void *arg);
+// -----------------------------------------------------------------------------
+// Encode the next nrows rows, each stride bytes after the last. Returns false
+// if there are more rows than the page has or the sink has failed.
+// -----------------------------------------------------------------------------
+bool jbig2_generic_push_rows(struct jbig2_generic_stream *stream,
+                             const uint8_t *data, int nrows, int stride);
+// -----------------------------------------------------------------------------
+// Finish the page and free stream. Returns false if the sink has failed.
+// -----------------------------------------------------------------------------
+bool jbig2_generic_end_page(struct jbig2_generic_stream *stream);
+
 // -------------------------------------------------------------------------------
 // jbig2enc_auto_threshold gathers classes of symbols and uses a single
-// representative to stand for them all.
+// representative to stand for them all. The templates are kept as Leptonica
+// PIXs from then on (see jbig2_use_native_classifier).
 // -------------------------------------------------------------------------------
 void jbig2enc_auto_threshold(struct jbig2ctx *ctx);
 
@@ -152,4 +484,18 @@ void jbig2enc_auto_threshold(struct jbig2ctx *ctx);
 // -------------------------------------------------------------------------------
 void jbig2enc_auto_threshold_using_hash(struct jbig2ctx *ctx);
 
+// -------------------------------------------------------------------------------
+// jbig2enc_auto_threshold_online performs automatic thresholding while the
+// pages are being added, rather than in one pass at the end. Each template that
+// jbig2_add_page creates is compared against the representants found so far as
+// it arrives, so the set of representants stays compact over a long document
+// and there is little left to do once the last page is in. The other templates
+// are retired straight away: their bitmaps are freed and later components are
+// not compared against them.
+//
+// Call this before the first jbig2_add_page. use_hash: see
+// jbig2enc_auto_threshold_using_hash.
+// -------------------------------------------------------------------------------
+void jbig2enc_auto_threshold_online(struct jbig2ctx *ctx, bool use_hash);
+
 #endif  // JBIG2ENC_JBIG2_H__
@@ -0,0 +1,245 @@
+// Copyright 2026 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <vector>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "jbig2pdf.h"
+
+#define u32 uint32_t
+#define u8  uint8_t
+
+// the catalog and the page tree are written last, but have fixed numbers so
+// that the pages can refer to the page tree
+static const int catalog_object = 1;
+static const int pages_object = 2;
+
+struct jbig2pdf {
+  int fd;
+  jbig2pdf_sink sink;  // if not NULL, used instead of fd
+  void *sink_arg;
+  int default_dpi;
+  size_t offset;  // the number of bytes written so far
+  bool failed;  // true once a write has failed
+  // the offset of each object, indexed by object number (0 is unused)
+  std::vector<size_t> objects;
+  std::vector<int> pages;  // the object number of each page
+};
+
+// -----------------------------------------------------------------------------
+// Write bytes to the PDF, keeping track of the offset
+// -----------------------------------------------------------------------------
+static void
+write_bytes(struct jbig2pdf *pdf, const void *data, size_t length) {
+  const u8 *p = (const u8 *) data;
+  if (pdf->sink && length && !pdf->failed) {
+    if (!pdf->sink(pdf->sink_arg, p, length)) {
+      fprintf(stderr, "Failed to write PDF output\n");
+      pdf->failed = true;
+      return;
+    }
+    pdf->offset += length;
+    return;
+  }
+  while (length && !pdf->failed) {
+    const int n = write(pdf->fd, p, length);
+    if (n <= 0) {
+      fprintf(stderr, "Failed to write PDF output\n");
+      pdf->failed = true;
+      return;
+    }
+    p += n;
+    length -= n;
+    pdf->offset += n;
+  }
+}
+
+static void
+write_format(struct jbig2pdf *pdf, const char *format, ...) {
+  va_list va;
+  va_start(va, format);
+  va_list va2;
+  va_copy(va2, va);
+  const int length = vsnprintf(NULL, 0, format, va);
+  std::vector<char> buffer(length + 1);
+  vsnprintf(buffer.data(), buffer.size(), format, va2);
+  va_end(va2);
+  va_end(va);
+  write_bytes(pdf, buffer.data(), length);
+}
+
+// -----------------------------------------------------------------------------
+// Start object number n (which must not have been written yet)
+// -----------------------------------------------------------------------------
+static void
+begin_object(struct jbig2pdf *pdf, int n) {
+  if ((int) pdf->objects.size() <= n) pdf->objects.resize(n + 1);
+  pdf->objects[n] = pdf->offset;
+  write_format(pdf, "%d 0 obj\n", n);
+}
+
+// -----------------------------------------------------------------------------
+// Returns the number of a new object
+// -----------------------------------------------------------------------------
+static int
+new_object(struct jbig2pdf *pdf) {
+  const int n = pdf->objects.size();
+  pdf->objects.resize(n + 1);
+  return n;
+}
+
+// -----------------------------------------------------------------------------
+// Write a stream object. dict is the contents of its dictionary, apart from
+// the length.
+// -----------------------------------------------------------------------------
+static void
+write_stream(struct jbig2pdf *pdf, int n, const char *dict, const u8 *data,
+             int length, const u8 *data2=NULL, int length2=0) {
+  begin_object(pdf, n);
+  write_format(pdf, "<< %s/Length %d >>\nstream\n", dict, length + length2);
+  write_bytes(pdf, data, length);
+  if (data2) write_bytes(pdf, data2, length2);
+  write_format(pdf, "\nendstream\nendobj\n");
+}
+
+static u32
+read_u32(const u8 *p) {
+  return ((u32) p[0] << 24) | ((u32) p[1] << 16) | ((u32) p[2] << 8) | p[3];
+}
+
+// -----------------------------------------------------------------------------
+// Start a PDF written to sink or, if that's NULL, to fd
+// -----------------------------------------------------------------------------
+static struct jbig2pdf *
+open_pdf(jbig2pdf_sink sink, void *arg, int default_dpi, int fd) {
+  struct jbig2pdf *const pdf = new jbig2pdf;
+  pdf->fd = fd;
+  pdf->sink = sink;
+  pdf->sink_arg = arg;
+  pdf->default_dpi = default_dpi;
+  pdf->offset = 0;
+  pdf->failed = false;
+  pdf->objects.resize(pages_object + 1);
+
+  // the comment of bytes over 127 marks the file as binary
+  write_format(pdf, "%%PDF-1.4\n%%\xe2\xe3\xcf\xd3\n");
+  return pdf;
+}
+
+// see comments in .h file
+struct jbig2pdf *
+jbig2pdf_open(int fd, int default_dpi) {
+  return open_pdf(NULL, NULL, default_dpi, fd);
+}
+
+// see comments in .h file
+struct jbig2pdf *
+jbig2pdf_open_sink(jbig2pdf_sink sink, void *arg, int default_dpi) {
+  return open_pdf(sink, arg, default_dpi, -1);
+}
+
+// see comments in .h file
+int
+jbig2pdf_add_globals(struct jbig2pdf *pdf, const uint8_t *data, int length,
+                     const uint8_t *data2, int length2) {
+  const int n = new_object(pdf);
+  write_stream(pdf, n, "", data, length, data2, length2);
+  return pdf->failed ? 0 : n;
+}
+
+// see comments in .h file
+bool
+jbig2pdf_add_page(struct jbig2pdf *pdf, const uint8_t *data, int length,
+                  int globals) {
+  // In PDF mode, a page starts with its page information segment, which has an
+  // 11 byte header: no referred to segments and page number 1. (7.2, 7.4.8)
+  if (length < 11 + 16 || (data[4] & 0x3f) != 48) {
+    fprintf(stderr, "Page doesn't start with a page information segment\n");
+    return false;
+  }
+  const u32 width = read_u32(data + 11);
+  const u32 height = read_u32(data + 15);
+  const u32 xres = read_u32(data + 19) ? read_u32(data + 19) : pdf->default_dpi;
+  const u32 yres = read_u32(data + 23) ? read_u32(data + 23) : pdf->default_dpi;
+  const double page_width = width * 72.0 / xres;
+  const double page_height = height * 72.0 / yres;
+
+  const int image = new_object(pdf);
+  char dict[256];
+  int dict_length = snprintf(dict, sizeof(dict),
+                             "/Type /XObject /Subtype /Image /Width %u "
+                             "/Height %u /ColorSpace /DeviceGray "
+                             "/BitsPerComponent 1 /Filter /JBIG2Decode ",
+                             width, height);
+  if (globals) {
+    snprintf(dict + dict_length, sizeof(dict) - dict_length,
+             "/DecodeParms << /JBIG2Globals %d 0 R >> ", globals);
+  }
+  write_stream(pdf, image, dict, data, length);
+
+  char contents[128];
+  const int contents_length =
+    snprintf(contents, sizeof(contents), "q %.4f 0 0 %.4f 0 0 cm /Im1 Do Q",
+             page_width, page_height);
+  const int contents_object = new_object(pdf);
+  write_stream(pdf, contents_object, "", (const u8 *) contents,
+               contents_length);
+
+  const int page = new_object(pdf);
+  begin_object(pdf, page);
+  write_format(pdf, "<< /Type /Page /Parent %d 0 R /MediaBox [ 0 0 %.4f %.4f ] "
+                    "/Contents %d 0 R /Resources << /ProcSet [/PDF /ImageB] "
+                    "/XObject << /Im1 %d 0 R >> >> >>\nendobj\n",
+               pages_object, page_width, page_height, contents_object, image);
+  pdf->pages.push_back(page);
+
+  return !pdf->failed;
+}
+
+// see comments in .h file
+bool
+jbig2pdf_close(struct jbig2pdf *pdf) {
+  begin_object(pdf, pages_object);
+  write_format(pdf, "<< /Type /Pages /Count %d /Kids [", (int) pdf->pages.size());
+  for (size_t i = 0; i < pdf->pages.size(); ++i) {
+    write_format(pdf, " %d 0 R", pdf->pages[i]);
+  }
+  write_format(pdf, " ] >>\nendobj\n");
+
+  begin_object(pdf, catalog_object);
+  write_format(pdf, "<< /Type /Catalog /Pages %d 0 R >>\nendobj\n",
+               pages_object);
+
+  // each entry of the cross reference table is exactly 20 bytes
+  const size_t xref = pdf->offset;
+  const int nobjects = pdf->objects.size();
+  write_format(pdf, "xref\n0 %d\n0000000000 65535 f \n", nobjects);
+  for (int i = 1; i < nobjects; ++i) {
+    write_format(pdf, "%010lu 00000 n \n", (unsigned long) pdf->objects[i]);
+  }
+  write_format(pdf, "trailer\n<< /Size %d /Root %d 0 R >>\nstartxref\n%lu\n"
+                    "%%%%EOF\n", nobjects, catalog_object, (unsigned long) xref);
+
+  const bool ok = !pdf->failed;
+  delete pdf;
+  return ok;
+}
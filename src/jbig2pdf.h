@@ -0,0 +1,80 @@
+// Copyright 2026 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef JBIG2ENC_JBIG2PDF_H__
+#define JBIG2ENC_JBIG2PDF_H__
+
+#if defined(sun)
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+#include <stddef.h>
+
+// -----------------------------------------------------------------------------
+// A minimal PDF writer for the output of the encoder in PDF mode (full_headers
+// false). Each page is an image XObject with the JBIG2Decode filter, scaled to
+// fill a page of the size given by its resolution.
+//
+// Objects are written to the file descriptor as they are added, straight from
+// the caller's buffers, and only their offsets are kept for the cross
+// reference table. So memory use doesn't depend on the size of the document.
+// -----------------------------------------------------------------------------
+
+struct jbig2pdf;
+
+// -----------------------------------------------------------------------------
+// Start a PDF, written to fd (which is not closed by jbig2pdf_close).
+//
+// default_dpi: the resolution of pages which don't give one
+// -----------------------------------------------------------------------------
+struct jbig2pdf *jbig2pdf_open(int fd, int default_dpi=72);
+
+// -----------------------------------------------------------------------------
+// Start a PDF which is passed, a piece at a time, to sink. sink returns false
+// if it fails, and then nothing more is written.
+// -----------------------------------------------------------------------------
+typedef bool (*jbig2pdf_sink)(void *arg, const uint8_t *data, size_t length);
+struct jbig2pdf *jbig2pdf_open_sink(jbig2pdf_sink sink, void *arg,
+                                    int default_dpi=72);
+
+// -----------------------------------------------------------------------------
+// Add a JBIG2Globals stream: the output of jbig2_pages_complete (in PDF mode).
+// If data2 is not NULL it is appended to data, for jbig2_cluster_symbols.
+//
+// Returns the object number of the stream, to pass to jbig2pdf_add_page, or 0
+// on error.
+// -----------------------------------------------------------------------------
+int jbig2pdf_add_globals(struct jbig2pdf *pdf, const uint8_t *data, int length,
+                         const uint8_t *data2=NULL, int length2=0);
+
+// -----------------------------------------------------------------------------
+// Add a page: the output of jbig2_produce_page or jbig2_encode_generic (in PDF
+// mode). Pages appear in the order in which they are added.
+//
+// globals: the object number of the JBIG2Globals stream of the page, or 0 if
+//          the page doesn't use one
+//
+// Returns false on error.
+// -----------------------------------------------------------------------------
+bool jbig2pdf_add_page(struct jbig2pdf *pdf, const uint8_t *data, int length,
+                       int globals);
+
+// -----------------------------------------------------------------------------
+// Write the page tree, the catalog and the cross reference table, and free
+// pdf. Returns false on error.
+// -----------------------------------------------------------------------------
+bool jbig2pdf_close(struct jbig2pdf *pdf);
+
+#endif  // JBIG2ENC_JBIG2PDF_H__
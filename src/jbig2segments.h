@@ -108,6 +108,17 @@ struct Segment {
       return page <= 255 ? 1 : 4;
   }
 
+  // ---------------------------------------------------------------------------
+  // Return the size of the referred-to segment count and retention flags.
+  // Up to four referred-to segments fit in the last byte of jbig2_segment,
+  // more need the long form: a 32-bit count and a bit for this segment and
+  // each referred-to segment. (7.2.4)
+  // ---------------------------------------------------------------------------
+  unsigned count_size() const {
+    if (referred_to.size() <= 4) return 1;
+    return sizeof(u32) + (referred_to.size() + 1 + 7) / 8;
+  }
+
   // ---------------------------------------------------------------------------
   // Return the number of bytes that this segment header will take up
   // ---------------------------------------------------------------------------
@@ -115,8 +126,8 @@ struct Segment {
     const int refsize = reference_size();
     const int pagesize = page_size();
 
-    return sizeof(struct jbig2_segment) + refsize * referred_to.size() +
-           pagesize + sizeof(u32);
+    return sizeof(struct jbig2_segment) - 1 + count_size() +
+           refsize * referred_to.size() + pagesize + sizeof(u32);
   }
 
   // ---------------------------------------------------------------------------
@@ -132,7 +143,7 @@ struct Segment {
     s.deferred_non_retain = deferred_non_retain;
     s.retain_bits = retain_bits;
 #undef F
-    s.segment_count = referred_to.size();
+    s.segment_count = referred_to.size() <= 4 ? referred_to.size() : 7;
 
     const int pagesize = page_size();
     const int refsize = reference_size();
@@ -140,12 +151,25 @@ struct Segment {
 
     unsigned j = 0;
 
-    memcpy(buf, &s, sizeof(s));
-    j += sizeof(s);
 #define APPEND(type, val) type __i; __i = val; \
     memcpy(&buf[j], &__i, sizeof(type)); \
     j += sizeof(type)
 
+    if (referred_to.size() <= 4) {
+      memcpy(buf, &s, sizeof(s));
+      j += sizeof(s);
+    } else {
+      // everything up to the short form count byte, then the long form
+      memcpy(buf, &s, sizeof(s) - 1);
+      j += sizeof(s) - 1;
+      {
+        APPEND(u32, htonl(0xe0000000 | referred_to.size()));
+      }
+      memset(&buf[j], 0, count_size() - sizeof(u32));
+      buf[j] = retain_bits;
+      j += count_size() - sizeof(u32);
+    }
+
     for (std::vector<unsigned>::const_iterator i = referred_to.begin();
          i != referred_to.end(); ++i) {
       if (refsize == 4) {
@@ -27,6 +27,7 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 
 #include <leptonica/allheaders.h>
 #if (LIBLEPT_MAJOR_VERSION == 1 && LIBLEPT_MINOR_VERSION >= 83) || LIBLEPT_MAJOR_VERSION > 1
@@ -36,7 +37,7 @@
 
 #include <math.h>
 
-#define S(i) symbols->pix[i]
+#include "jbig2sym.h"
 
 
 // -----------------------------------------------------------------------------
@@ -50,62 +51,152 @@ myiota(_ForwardIterator __first, _ForwardIterator __last, _Tp __val) {
 }
 
 // -----------------------------------------------------------------------------
-// Sorts a vector of indexes into the symbols PIXA by height. This is needed
-// because symbols are placed into the JBIG2 table in height order
+// Sorts a vector of template numbers by height. This is needed because symbols
+// are placed into the JBIG2 table in height order
 // -----------------------------------------------------------------------------
 class HeightSorter {  // concept: stl/StrictWeakOrdering
  public:
-  HeightSorter(const PIXA *isymbols)
-      : symbols(isymbols) {}
+  HeightSorter(const struct jbig2enc_templates *itemplates)
+      : templates(itemplates) {}
 
   bool operator() (int x, int y) {
-    return S(x)->h < S(y)->h;
+    return templates->h[x] < templates->h[y];
   }
 
  private:
-  const PIXA *const symbols;
+  const struct jbig2enc_templates *const templates;
 };
 
 // -----------------------------------------------------------------------------
-// Sorts a vector of indexes into the symbols PIXA by width. This is needed
-// because symbols are placed into the JBIG2 table in width order (for a given
-// height class)
+// Sorts a vector of template numbers by width. This is needed because symbols
+// are placed into the JBIG2 table in width order (for a given height class)
 // -----------------------------------------------------------------------------
 class WidthSorter {  // concept: stl/StrictWeakOrdering
  public:
-  WidthSorter(const PIXA *isymbols)
-      : symbols(isymbols) {}
+  WidthSorter(const struct jbig2enc_templates *itemplates)
+      : templates(itemplates) {}
 
   bool operator() (int x, int y) {
-    return S(x)->w < S(y)->w;
+    return templates->w[x] < templates->w[y];
   }
 
  private:
-  const PIXA *const symbols;
+  const struct jbig2enc_templates *const templates;
 };
 
-static const int kBorderSize = 6;
+// see comment in .h file
+void
+jbig2enc_templates_add(struct jbig2enc_templates *templates, PIX *const pix,
+                       const int border) {
+  const int w = pix->w - 2 * border;
+  const int h = pix->h - 2 * border;
+  const int wpl = (w + 31) / 32;
+  const int shift = border & 31;
+  // the bits in the last word of a row which are part of the image
+  const uint32_t lastmask = 0xffffffffu << ((32 - (w & 31)) & 31);
+
+  const size_t offset = templates->bits.size();
+  templates->bits.resize(offset + (size_t) wpl * h);
+  uint32_t *out = &templates->bits[offset];
+  int area = 0;
+  for (int y = 0; y < h; ++y) {
+    const uint32_t *const row = pix->data + (size_t) (y + border) * pix->wpl +
+                                (border >> 5);
+    for (int k = 0; k < wpl; ++k) {
+      uint32_t word = row[k] << shift;
+      if (shift && (border >> 5) + k + 1 < (int) pix->wpl) {
+        word |= row[k + 1] >> (32 - shift);
+      }
+      if (k == wpl - 1) word &= lastmask;
+      *out++ = word;
+      for (uint32_t v = word; v; v &= v - 1) area++;
+    }
+  }
+
+  templates->offset.push_back(offset);
+  templates->w.push_back(w);
+  templates->h.push_back(h);
+  templates->area.push_back(area);
+}
+
+// see comment in .h file
+PIX *
+jbig2enc_templates_pix(const struct jbig2enc_templates *templates, const int n,
+                       const int border) {
+  const int w = templates->w[n];
+  const int h = templates->h[n];
+  const int wpl = (w + 31) / 32;
+
+  PIX *pix = pixCreate(w, h, 1);
+  const uint32_t *const in = &templates->bits[templates->offset[n]];
+  for (int y = 0; y < h; ++y) {
+    memcpy(pix->data + (size_t) y * pix->wpl, in + (size_t) y * wpl,
+           wpl * sizeof(uint32_t));
+  }
+  if (!border) return pix;
+
+  PIX *const bordered = pixAddBorder(pix, border, 0);
+  pixDestroy(&pix);
+  return bordered;
+}
+
+// see comment in .h file
+void
+jbig2enc_templates_truncate(struct jbig2enc_templates *templates, int n) {
+  if ((size_t) n >= templates->offset.size()) return;
+  templates->bits.resize(templates->offset[n]);
+  templates->offset.resize(n);
+  templates->w.resize(n);
+  templates->h.resize(n);
+  templates->area.resize(n);
+}
+
+// see comment in .h file
+void
+jbig2enc_symbol_order(const struct jbig2enc_templates *templates,
+                      const unsigned *symbol_list, const int nsymbols,
+                      std::vector<unsigned> *order) {
+  const unsigned n = nsymbols;
+
+  // this is a vector of template numbers
+  std::vector<unsigned> &syms = *order;
+  syms.assign(symbol_list, symbol_list + n);
+  // now sort that vector by height
+  std::sort(syms.begin(), syms.end(), HeightSorter(templates));
+
+  // this is used for each height class to sort into increasing width
+  WidthSorter sorter(templates);
+
+  for (unsigned i = 0; i < n;) {
+    unsigned j;
+    // walk the vector until we find a symbol with a different height
+    for (j = i + 1; j < n; ++j) {
+      if (templates->h[syms[j]] != templates->h[syms[i]]) break;
+    }
+    // all the symbols from i to j-1 are a height class
+    // now sort them into increasing width
+    std::sort(syms.begin() + i, syms.begin() + j, sorter);
+    i = j;
+  }
+}
 
 // see comment in .h file
 void
 jbig2enc_symboltable(struct jbig2enc_ctx *restrict ctx,
-                     PIXA *restrict const symbols,
-                     std::vector<unsigned> *__restrict__ symbol_list,
-                     std::map<int, int> *symmap, const bool unborder_symbols) {
-  const unsigned n = symbol_list->size();
-  int number = 0;
+                     const struct jbig2enc_templates *templates,
+                     const unsigned *__restrict__ symbol_list,
+                     const int nsymbols, std::vector<int> *symmap,
+                     const int first_id) {
+  const unsigned n = nsymbols;
+  int number = first_id;
 
 #ifdef JBIG2_DEBUGGING
   fprintf(stderr, "  symbols: %d\n", n);
 #endif
 
-  // this is a vector of indexes into symbols
-  std::vector<unsigned> syms(*symbol_list);
-  // now sort that vector by height
-  std::sort(syms.begin(), syms.end(), HeightSorter(symbols));
-
-  // this is used for each height class to sort into increasing width
-  WidthSorter sorter(symbols);
+  // this is a vector of template numbers, in the order they are written
+  std::vector<unsigned> syms;
+  jbig2enc_symbol_order(templates, symbol_list, nsymbols, &syms);
 
   // this stores the indexes of the symbols for a given height class
   std::vector<int> hc;
@@ -113,7 +204,7 @@ jbig2enc_symboltable(struct jbig2enc_ctx *restrict ctx,
   unsigned hcheight = 0;
   for (unsigned i = 0; i < n;) {
     // height is the height of this class of symbols
-    const unsigned height = S(syms[i])->h - (unborder_symbols ? 2*kBorderSize : 0);
+    const unsigned height = templates->h[syms[i]];
 #ifdef JBIG2_DEBUGGING
     fprintf(stderr, "height is %d\n", height);
 #endif
@@ -122,15 +213,14 @@ jbig2enc_symboltable(struct jbig2enc_ctx *restrict ctx,
     hc.push_back(syms[i]);  // this is the first member of the new class
     // walk the vector until we find a symbol with a different height
     for (j = i + 1; j < n; ++j) {
-      if (S(syms[j])->h - (unborder_symbols ? 2*kBorderSize : 0) != height) break;
+      if ((unsigned) templates->h[syms[j]] != height) break;
       hc.push_back(syms[j]);  // add each symbol of the same height to the class
     }
 #ifdef JBIG2_DEBUGGING
     fprintf(stderr, "  hc (height: %d, members: %d)\n", height, hc.size());
 #endif
-    // all the symbols from i to j-1 are a height class
-    // now sort them into increasing width
-    sort(hc.begin(), hc.end(), sorter);
+    // all the symbols from i to j-1 are a height class, already sorted into
+    // increasing width
     // encode the delta height
     const int deltaheight = height - hcheight;
     jbig2enc_int(ctx, JBIG2_IADH, deltaheight);
@@ -139,29 +229,20 @@ jbig2enc_symboltable(struct jbig2enc_ctx *restrict ctx,
     // encode each symbol
     for (std::vector<int>::const_iterator k = hc.begin(); k != hc.end(); ++k) {
       const int sym = *k;
-      const int thissymwidth = S(sym)->w - (unborder_symbols ? 2*kBorderSize : 0);
+      const int thissymwidth = templates->w[sym];
       const int deltawidth = thissymwidth - symwidth;
 #ifdef JBIG2_DEBUGGING
-      fprintf(stderr, "    h: %d\n", S(sym)->w);
+      fprintf(stderr, "    h: %d\n", templates->w[sym]);
 #endif
       symwidth += deltawidth;
-      //fprintf(stderr, "width is %d\n", S(sym)->w);
+      //fprintf(stderr, "width is %d\n", templates->w[sym]);
       jbig2enc_int(ctx, JBIG2_IADW, deltawidth);
 
-      PIX *unbordered;
-      if (unborder_symbols) {
-        // the exemplars are stored with a border
-        unbordered = pixRemoveBorder(S(sym), kBorderSize);
-        // encoding the bitmap requires that the pad bits be zero
-      } else {
-        unbordered = pixClone(S(sym));
-      }
-      pixSetPadBits(unbordered, 0);
-      jbig2enc_bitimage(ctx, (uint8_t *) unbordered->data, thissymwidth, height,
-                        false);
+      jbig2enc_bitimage(ctx, (const uint8_t *) &templates->bits[templates->offset[sym]],
+                        thissymwidth, height, false);
       // add this symbol to the map
-      (*symmap)[sym] = number++;
-      pixDestroy(&unbordered);
+      if (symmap) (*symmap)[sym] = number;
+      number++;
     }
     // OOB marks the end of the height class
     //fprintf(stderr, "OOB\n");
@@ -213,17 +294,30 @@ class XSorter {  // concept: stl/StrictWeakOrdering
 
 #define BY(x) (lrint(ll->y[x]))
 
+// -----------------------------------------------------------------------------
+// Returns space for n ints, from the coder's arena if it has one (so that it's
+// reused from page to page) and otherwise from storage
+// -----------------------------------------------------------------------------
+static int *
+temp_ints(struct jbig2enc_ctx *ctx, int n, std::vector<int> *storage) {
+  if (ctx->arena) {
+    return (int *) jbig2enc_arena_alloc(ctx->arena, (size_t) n * sizeof(int));
+  }
+  storage->resize(n);
+  return storage->data();
+}
+
 // see comment in .h file
 void
 jbig2enc_textregion(struct jbig2enc_ctx *restrict ctx,
-                    /*const*/ std::map<int, int> &symmap,
-                    /*const*/ std::map<int, int> &symmap2,
-                    const std::vector<int> &comps,
+                    const std::vector<int> &symmap,
+                    const std::vector<std::pair<unsigned, int> > *page_symbols,
+                    const int first_comp, const int ncomps,
                     PTA *const in_ll,
-                    PIXA *const symbols,
+                    const struct jbig2enc_templates *templates,
                     NUMA *assignments, int stripwidth, int symbits,
                     PIXA *const source, BOXA *boxes, int baseindex,
-                    int refine_level, bool unborder_symbols) {
+                    int refine_level) {
   // these are the only valid values for stripwidth
   if (stripwidth != 1 && stripwidth != 2 && stripwidth != 4 &&
       stripwidth != 8) {
@@ -249,25 +343,26 @@ jbig2enc_textregion(struct jbig2enc_ctx *restrict ctx,
     ll = in_ll;
   }
 
-  const int n = comps.size();
+  const int n = ncomps;
 
   // sort each box by distance from the top of the page
-  // syms (a copy of comps) is a list of indexes into symmap and ll
+  // syms (the components of the page) is a list of indexes into symmap and ll
   // elements which are indexes into symmap and ll are labeled I
   // indexes into the syms array are labeled II
-  std::vector<int> syms(n);
+  std::vector<int> syms_storage, strip_storage;
+  int *const syms = temp_ints(ctx, n, &syms_storage);
   if (source) {
     // refining: fill syms with the numbers 0..n because ll is relative to this
     // page in this case
-    myiota(syms.begin(), syms.end(), 0);
+    myiota(syms, syms + n, 0);
   } else {
-    // fill syms with the component numbers from the comps array because ll is
+    // fill syms with the component numbers of this page because ll is
     // absolutely indexed in this case (absolute: over the whole multi-page
     // document)
-    syms = comps;
+    myiota(syms, syms + n, first_comp);
   }
   // sort into height order
-  sort(syms.begin(), syms.end(), YSorter(ll));
+  std::sort(syms, syms + n, YSorter(ll));
 
   XSorter sorter(ll);
 
@@ -282,12 +377,12 @@ jbig2enc_textregion(struct jbig2enc_ctx *restrict ctx,
 
   // for each symbol we group it into a strip, which is stripwidth px high
   // for each strip we sort into left-right order
-  std::vector<int> strip; // elements of strip: I
+  int *const strip = temp_ints(ctx, n, &strip_storage); // elements: I
   for (int i = 0; i < n;) {   // i: II
     const int height = (BY(syms[i]) / stripwidth) * stripwidth;
     int j;
-    strip.clear();
-    strip.push_back(syms[i]);
+    int strip_size = 0;
+    strip[strip_size++] = syms[i];
 
     // now walk until we hit the first symbol which isn't in this strip
     for (j = i + 1; j < n; ++j) {  // j: II
@@ -296,11 +391,11 @@ jbig2enc_textregion(struct jbig2enc_ctx *restrict ctx,
         // outside strip
         break;
       }
-      strip.push_back(syms[j]);
+      strip[strip_size++] = syms[j];
     }
 
     // now sort the strip into left-right order
-    sort(strip.begin(), strip.end(), sorter);
+    std::sort(strip, strip + strip_size, sorter);
     const int deltat = height - stript;
 #ifdef SYM_DEBUGGING
     fprintf(stderr, "deltat is %d\n", deltat);
@@ -314,7 +409,7 @@ jbig2enc_textregion(struct jbig2enc_ctx *restrict ctx,
     bool firstsymbol = true;
     int curs = 0;
     // k: iterator(I)
-    for (std::vector<int>::const_iterator k = strip.begin(); k != strip.end(); ++k) {
+    for (const int *k = strip; k != strip + strip_size; ++k) {
       const int sym = *k;  // sym: I
       if (firstsymbol) {
         firstsymbol = false;
@@ -343,28 +438,22 @@ jbig2enc_textregion(struct jbig2enc_ctx *restrict ctx,
         [sym + (source ? baseindex : 0)];
 
       // the symmap maps the number of the symbol from the classifier to the
-      // order in while it was written in the symbol dict
-
-      // We have two symbol dictionaries. A global one and a per-page one.
-      int symid;
-      std::map<int, int>::const_iterator symit = symmap.find(assigned);
-      if (symit != symmap.end()) {
-        symid = symit->second;
-      } else {
-        symit = symmap2.find(assigned);
-        if (symit != symmap2.end()) {
-          symid = symit->second + symmap.size();
-        } else {
-          for (symit = symmap.begin(); symit != symmap.end(); ++symit) {
-            fprintf(stderr, "%d ", symit->first);
-          }
-          for (symit = symmap2.begin(); symit != symmap2.end(); ++symit) {
-            fprintf(stderr, "%d ", symit->first);
-          }
-          fprintf(stderr, "\n%d\n", assigned);
-          abort();
+      // order in while it was written in the symbol dict. We have two symbol
+      // dictionaries, a global one and a per-page one, and the symbols of the
+      // per-page one are numbered after those of the global one.
+      int symid = symmap[assigned];
+      if (symid < 0 && page_symbols) {
+        const std::vector<std::pair<unsigned, int> >::const_iterator it =
+          std::lower_bound(page_symbols->begin(), page_symbols->end(),
+                           std::make_pair((unsigned) assigned, -1));
+        if (it != page_symbols->end() && it->first == (unsigned) assigned) {
+          symid = it->second;
         }
       }
+      if (symid < 0) {
+        fprintf(stderr, "symbol %d is not in any symbol dictionary\n", assigned);
+        abort();
+      }
 #ifdef SYM_DEBUGGING
       fprintf(stderr, "sym: %d\n", symid);
 #endif
@@ -377,14 +466,10 @@ jbig2enc_textregion(struct jbig2enc_ctx *restrict ctx,
         // number.
         const int abssym = baseindex + sym;
 
-        PIX *symbol;
-        if (unborder_symbols) {
-          // the symbol has a 6 px border around it, which we need to remove
-          symbol = pixRemoveBorder(S(assigned), kBorderSize);
-        } else {
-          symbol = pixClone(S(assigned));
-        }
-        pixSetPadBits(symbol, 0);
+        // the templates are laid out like a 1 bpp PIX, so one can be copied
+        PIX *symbol = pixCreate(templates->w[assigned], templates->h[assigned], 1);
+        memcpy(symbol->data, &templates->bits[templates->offset[assigned]],
+               (size_t) symbol->wpl * symbol->h * sizeof(uint32_t));
 
         const int targetw = boxes->box[sym]->w;
         const int targeth = boxes->box[sym]->h;
@@ -428,7 +513,7 @@ jbig2enc_textregion(struct jbig2enc_ctx *restrict ctx,
           // refinement disabled.
           jbig2enc_int(ctx, JBIG2_IARI, 0);
           // update curs given the width of the bitmap
-          curs += (S(assigned)->w - (unborder_symbols ? 2*kBorderSize : 0)) - 1;
+          curs += templates->w[assigned] - 1;
         } else {
           wibble++;
           jbig2enc_int(ctx, JBIG2_IARI, 1);
@@ -448,7 +533,7 @@ jbig2enc_textregion(struct jbig2enc_ctx *restrict ctx,
         }
       } else {
         // update curs given the width of the bitmap
-        curs += (S(assigned)->w - (unborder_symbols ? 2*kBorderSize : 0)) - 1;
+        curs += templates->w[assigned] - 1;
       }
     }
     // terminate the strip
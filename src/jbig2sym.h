@@ -20,23 +20,71 @@
 
 struct jbig2enc_ctx;
 
+// -----------------------------------------------------------------------------
+// A compact store of symbol templates. The bitmaps have no border and are
+// packed one after another in a single array, each row a whole number of
+// 32-bit words in Leptonica's layout (the leftmost pixel in the top bit of a
+// native-endian word) with the pad bits clear. Everything else is kept in
+// parallel arrays indexed by template number. There is no baseline: text
+// regions place symbols by their bottom-left corner, which is h - 1 rows below
+// the top, and neither classifier finds a typographic baseline.
+// -----------------------------------------------------------------------------
+struct jbig2enc_templates {
+  std::vector<uint32_t> bits;
+  std::vector<size_t> offset;  // index of the first word of each template
+  std::vector<int> w, h;  // size of each template
+  std::vector<int> area;  // number of ON pixels in each template
+};
+
+// -----------------------------------------------------------------------------
+// Append a copy of pix, less a border of the given width, to templates.
+// -----------------------------------------------------------------------------
+void jbig2enc_templates_add(struct jbig2enc_templates *templates,
+                            PIX *const pix, int border);
+
+// -----------------------------------------------------------------------------
+// Return a new PIX with a copy of template n, plus a clear border of the given
+// width, for code which needs the templates as Leptonica has them.
+// -----------------------------------------------------------------------------
+PIX *jbig2enc_templates_pix(const struct jbig2enc_templates *templates, int n,
+                            int border);
+
+// -----------------------------------------------------------------------------
+// Remove every template from number n onwards. Their bitmaps must have been
+// added after those of the templates which are kept.
+// -----------------------------------------------------------------------------
+void jbig2enc_templates_truncate(struct jbig2enc_templates *templates, int n);
+
+// -----------------------------------------------------------------------------
+// Sort symbols into the order in which jbig2enc_symboltable writes them: by
+// height and, within each height, by width.
+//
+// symbol_list: an array of nsymbols template numbers
+// order: filled with the members of symbol_list, sorted
+// -----------------------------------------------------------------------------
+void jbig2enc_symbol_order(const struct jbig2enc_templates *templates,
+                           const unsigned *symbol_list, int nsymbols,
+                           std::vector<unsigned> *order);
+
 // -----------------------------------------------------------------------------
 // Write a symbol table.
 //
-// symbols: A 2d array. The first dimension is of different classes of symbols.
-//          Then, for each class, there are all the examples of that class. The
-//          first member of the class is taken as the exemplar.
-// symbol_list: a list of symbols to encode
-// symmap: an empty map which is filled. The symbols are written to the file in
-//         a different order than they are given in symbols. The maps an index
-//         into the symbols array to a symbol number in the file
-// unborder_symbols: if true, remove a border from every element of symbols
+// templates: the symbol bitmaps
+// symbol_list: an array of nsymbols template numbers to encode
+// symmap: an array with an element for every template. The symbols are
+//         written to the file in a different order than they are given in
+//         symbol_list. For each symbol encoded, this is set to the number of
+//         that symbol in the file, plus first_id. Other elements are left
+//         alone. May be NULL if the numbers are already known (see
+//         jbig2enc_symbol_order)
+// first_id: the symbol number of the first symbol of this table, i.e. the
+//           number of symbols in the tables which come before it
 // -----------------------------------------------------------------------------
 void jbig2enc_symboltable(struct jbig2enc_ctx *__restrict__ ctx,
-                          PIXA *__restrict__ const symbols,
-                          std::vector<unsigned> *__restrict__ symbol_list,
-                          std::map<int, int> *symmap,
-                          bool unborder_symbols);
+                          const struct jbig2enc_templates *templates,
+                          const unsigned *__restrict__ symbol_list,
+                          int nsymbols, std::vector<int> *symmap,
+                          int first_id);
 
 // -----------------------------------------------------------------------------
 // Write a text region.
@@ -45,10 +93,15 @@ void jbig2enc_symboltable(struct jbig2enc_ctx *__restrict__ ctx,
 // have been coded.
 //
 // symmap: This maps class numbers to symbol numbers. Only symbol numbers
-//         appear in the JBIG2 data stream
-// symmap2: If not found in the first symmap, try this one
-// comps: a list of connected-component numbers for this page
+//         appear in the JBIG2 data stream. Classes which aren't in any of the
+//         symbol tables for this page are -1.
+// page_symbols: the numbers of the symbols which symmap doesn't have, as
+//               (class, symbol number) pairs sorted by class, or NULL
+// first_comp: the number of the first connected component on this page. The
+//             components of a page are numbered consecutively
+// ncomps: the number of connected components on this page
 // ll: This is an array of the lower-left corners of the boxes for each symbol
+// templates: the symbol bitmaps
 // assignments: an array, of the same length as boxes, mapping each box to a
 //              symbol
 // stripwidth: 1 is a safe default (one of [1, 2, 4, 8])
@@ -61,16 +114,16 @@ void jbig2enc_symboltable(struct jbig2enc_ctx *__restrict__ ctx,
 // baseindex: if source is non-NULL, this is the component number of the first
 //            component on this page
 // refine_level: the number of incorrect pixels allowed before refining.
-// unborder_symbols: if true, symbols have a 6px border around them
 // -----------------------------------------------------------------------------
 void jbig2enc_textregion(struct jbig2enc_ctx *__restrict__ ctx,
-                         /*const*/ std::map<int, int> &symmap,
-                         /*const*/ std::map<int, int> &symmap2,
-                         const std::vector<int> &comps,
-                         PTA *const ll, PIXA *const symbols,
+                         const std::vector<int> &symmap,
+                         const std::vector<std::pair<unsigned, int> > *page_symbols,
+                         int first_comp, int ncomps,
+                         PTA *const ll,
+                         const struct jbig2enc_templates *templates,
                          NUMA *assignments,
                          int stripwidth, int symbits,
                          PIXA *const source, BOXA *boxes, int baseindex,
-                         int refine_level, bool unborder_symbols);
+                         int refine_level);
 
 #endif  // JBIG2ENC_JBIG2SYM_H__